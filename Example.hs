@@ -1,27 +1,15 @@
 module Example where
 import qualified Synth
+import Synth (Pitch(..), Duration(..), note, times)
 
 main = do
         (Synth.initSynth)
-        (loop majorPhrase 2)
+        (Synth.playScoreOn 0 250 (times 2 majorPhrase))
+        (Synth.endOscWait 0)
         (Synth.termSynth)
 
-loop f 1 = do (f)
-loop f n = do
-            (f)
-            (loop f (n-1))
+majorPhrase = mconcat [times 4 phraseA, times 4 phraseB]
 
+phraseA = mconcat [note C 4 Whole, note E 4 Whole, note G 4 Whole]
 
-
-majorPhrase = do
-        (loop phraseA 4)
-        (loop phraseB 4)
-phraseA = do
-        (Synth.play "C4"  "w" 250)
-        (Synth.play "E4"  "w" 250)
-        (Synth.play "G4"  "w" 250)
-
-phraseB = do
-        (Synth.play "D4"  "w" 250)
-        (Synth.play "F4"  "w" 250)
-        (Synth.play "A4"  "w" 250)
+phraseB = mconcat [note D 4 Whole, note F 4 Whole, note A 4 Whole]
@@ -1,55 +1,47 @@
 module Mary where
 import qualified Synth
+import Synth (Pitch(..), Duration(..), note)
 
 main = do
         (Synth.initSynth)
-        (maryHadALamb 1500)
+        (Synth.playScoreOn 0 1500 maryHadALamb)
+        (Synth.endOscWait 0)
+        (Synth.endOscWait 1)
         (Synth.termSynth)
 
-maryHadALamb wholeDur = do
-        (mary   wholeDur)
-        (lambA  wholeDur)
-        (lambB  wholeDur)
-        (lambC  wholeDur)
-        (mary   wholeDur)
-        (lambD  wholeDur)
-        (fleece wholeDur)
-        (snow   wholeDur)
-        (Synth.endOsc 0)
-        (Synth.endOsc 1)
-
-mary wholeDur = do
-        (Synth.play "B4"  "q" wholeDur)
-        (Synth.play "A4"  "q" wholeDur)
-        (Synth.play "G4"  "q" wholeDur)
-        (Synth.play "A4"  "q" wholeDur)
-
-lambA wholeDur = do
-        (Synth.play "B4"  "q" wholeDur)
-        (Synth.play "B4"  "q" wholeDur)
-        (Synth.play "B4"  "h" wholeDur)
-    
-lambB wholeDur = do
-        (Synth.play "A4"  "q" wholeDur)
-        (Synth.play "A4"  "q" wholeDur)
-        (Synth.play "A4"  "h" wholeDur)
-
-lambC wholeDur = do
-        (Synth.play "B4"  "q" wholeDur)
-        (Synth.play "D5"  "q" wholeDur)
-        (Synth.play "D5"  "h" wholeDur)
-
-lambD wholeDur = do
-        (Synth.play "B4"  "q" wholeDur)
-        (Synth.play "B4"  "q" wholeDur)
-        (Synth.play "B4"  "q" wholeDur)
-        (Synth.play "B4"  "q" wholeDur)
-
-fleece wholeDur = do
-        (Synth.play "A4"  "q" wholeDur)
-        (Synth.play "A4"  "q" wholeDur)
-        (Synth.play "B4"  "q" wholeDur)
-        (Synth.play "A4"  "q" wholeDur)
-
-snow wholeDur = do
-        (Synth.play "G4"  "w" wholeDur)
+maryHadALamb = mconcat [mary, lambA, lambB, lambC, mary, lambD, fleece, snow]
+
+mary = mconcat [
+        note B 4 Quarter,
+        note A 4 Quarter,
+        note G 4 Quarter,
+        note A 4 Quarter]
+
+lambA = mconcat [
+        note B 4 Quarter,
+        note B 4 Quarter,
+        note B 4 Half]
+
+lambB = mconcat [
+        note A 4 Quarter,
+        note A 4 Quarter,
+        note A 4 Half]
+
+lambC = mconcat [
+        note B 4 Quarter,
+        note D 5 Quarter,
+        note D 5 Half]
+
+lambD = mconcat [
+        note B 4 Quarter,
+        note B 4 Quarter,
+        note B 4 Quarter,
+        note B 4 Quarter]
+
+fleece = mconcat [
+        note A 4 Quarter,
+        note A 4 Quarter,
+        note B 4 Quarter,
+        note A 4 Quarter]
+
+snow = note G 4 Whole
@@ -1,32 +1,212 @@
 {-# LANGUAGE ForeignFunctionInterface #-}
 module Synth where
 import Foreign.C
+import Foreign.Ptr
+import Foreign.Storable
+import Foreign.Marshal.Array
+import Foreign.ForeignPtr
+import Data.Ix (inRange)
+import Data.Semigroup (Semigroup(..))
+import Data.Array.Unboxed (UArray, listArray, bounds, (!))
 
-foreign import ccall "initSynth" initSynth :: IO ()
+foreign import ccall "initSynth" c_initSynth :: IO CInt
 foreign import ccall "termSynth" termSynth :: IO ()
-foreign import ccall "playOsc" playOsc :: CInt -> CInt -> CDouble -> IO ()
-foreign import ccall "restOsc" restOsc :: CInt -> CInt -> IO ()
-foreign import ccall "endOsc" endOsc :: CInt -> IO ()
+-- playOsc, restOsc and endOsc return 1 if the note was queued, 0 if the
+-- oscillator's queue was full
+foreign import ccall "playOsc" playOsc :: CInt -> CInt -> CDouble -> IO CInt
+foreign import ccall "restOsc" restOsc :: CInt -> CInt -> IO CInt
+foreign import ccall "endOsc" endOsc :: CInt -> IO CInt
+foreign import ccall "waitOscSpace" waitOscSpace :: CInt -> CUInt -> IO CInt
+foreign import ccall "playOscBatch" c_playOscBatch :: CInt -> Ptr Note -> CSize -> IO CSize
+foreign import ccall "playOscBatchWait" c_playOscBatchWait :: CInt -> Ptr Note -> CSize -> IO CSize
+foreign import ccall "noteOn" noteOn :: CDouble -> CUInt -> CDouble -> IO CLong
+foreign import ccall "noteOff" noteOff :: CLong -> IO CInt
+foreign import ccall "loadWavetable" loadWavetable :: CString -> IO CInt
+foreign import ccall "setOscTable" setOscTable :: CInt -> CInt -> IO CInt
+foreign import ccall "setOscPan" setOscPan :: CInt -> CDouble -> IO CInt
+foreign import ccall "setOscBus" setOscBus :: CInt -> CInt -> IO CInt
+foreign import ccall "setBusGain" setBusGain :: CInt -> CDouble -> IO CInt
+foreign import ccall "setMasterGain" setMasterGain :: CDouble -> IO CInt
+foreign import ccall "getSynthLatency" getSynthLatency :: IO CDouble
 
 
+-- A note for playBatch, stored the same way as struct note in synth.h
+data Note = Note CInt CDouble   -- duration in milliseconds, frequency
+          | Rest CInt           -- duration in milliseconds
+          | End
+
+instance Storable Note where
+        sizeOf _ = 16
+        alignment _ = 8
+        peek p = do
+                t <- peekByteOff p 0 :: IO CInt
+                ms <- peekByteOff p 4
+                hz <- peekByteOff p 8
+                return (case t of
+                        0 -> Note ms hz
+                        1 -> Rest ms
+                        _ -> End)
+        poke p (Note ms hz) = pokeNote p 0 ms hz
+        poke p (Rest ms) = pokeNote p 1 ms 0
+        poke p End = pokeNote p 3 0 0
+
+pokeNote :: Ptr Note -> CInt -> CInt -> CDouble -> IO ()
+pokeNote p t ms hz = do
+        pokeByteOff p 0 t
+        pokeByteOff p 4 ms
+        pokeByteOff p 8 hz
+
+
+-- Queue a list of notes on an oscillator with a single call into C.
+-- Returns how many of them fit in the oscillator's queue
+playBatch :: CInt -> [Note] -> IO CSize
+playBatch osc notes = withArrayLen notes send
+        where send len ptr = c_playOscBatch osc ptr (fromIntegral len)
+
+
+
+-- A score is plain data: which notes to play and how long each lasts as a
+-- fraction of a whole note. compileScore lays it out once as a buffer of
+-- struct notes, and playScore queues that buffer with a single call into C
+data Pitch = C | Cs | D | Ds | E | F | Fs | G | Gs | A | As | B
+        deriving (Eq, Ord, Enum, Bounded, Show)
+
+data Duration = Whole | Half | Quarter | Eighth | Sixteenth
+              | Dotted Duration         -- half as long again
+        deriving (Eq, Show)
+
+-- keys are MIDI note numbers, so C4 is 60
+data Event = Tone !Int !Duration
+           | Pause !Duration
+        deriving (Eq, Show)
+
+-- scores are sequenced with <> and mconcat. They're kept as difference
+-- lists, so a long piece built up a phrase at a time appends in constant time
+newtype Score = Score ([Event] -> [Event])
+
+instance Semigroup Score where
+        Score a <> Score b = Score (a . b)
+
+instance Monoid Score where
+        mempty = Score id
+        mappend = (<>)
+
+-- a single note, such as note C 4 Quarter. Octaves run from -1 to 9
+note :: Pitch -> Int -> Duration -> Score
+note pitch octave len
+        | inRange (bounds pitchTable) key = event (Tone key len)
+        | otherwise = error ("note: octave " ++ show octave ++ " is out of range")
+        where key = 12 * (octave + 1) + fromEnum pitch
+
+rest :: Duration -> Score
+rest len = event (Pause len)
+
+event :: Event -> Score
+event e = Score (e :)
+
+-- the score played n times over
+times :: Int -> Score -> Score
+times n score = mconcat (replicate n score)
+
+scoreEvents :: Score -> [Event]
+scoreEvents (Score f) = f []
+
+-- the frequency of every key, equal-tempered around A4 at 440 Hz
+pitchTable :: UArray Int Double
+pitchTable = listArray (0, 131) [440 * 2 ** ((fromIntegral k - 69) / 12) | k <- [0 .. 131 :: Int]]
+
+-- how many milliseconds a duration lasts, given a whole note's
+durationMs :: CInt -> Duration -> CInt
+durationMs whole Whole = whole
+durationMs whole Half = quot whole 2
+durationMs whole Quarter = quot whole 4
+durationMs whole Eighth = quot whole 8
+durationMs whole Sixteenth = quot whole 16
+durationMs whole (Dotted len) = ms + quot ms 2
+        where ms = durationMs whole len
+
+compileEvent :: CInt -> Event -> Note
+compileEvent whole (Tone key len) = Note (durationMs whole len) (realToFrac (pitchTable ! key))
+compileEvent whole (Pause len) = Rest (durationMs whole len)
+
+-- a compiled score: count notes stored the same way as struct note
+data NoteBuffer = NoteBuffer !(ForeignPtr Note) !Int
+
+-- lays a score out for playScore, with a whole note lasting whole ms. The
+-- buffer can be played any number of times, on any oscillator
+compileScore :: CInt -> Score -> IO NoteBuffer
+compileScore whole score = do
+        let events = scoreEvents score
+            count = length events
+        fp <- mallocForeignPtrArray count
+        withForeignPtr fp (\p -> fill p 0 events)
+        return (NoteBuffer fp count)
+        where fill _ _ [] = return ()
+              fill p i (e : es) = do
+                        pokeElemOff p i (compileEvent whole e)
+                        fill p (i + 1) es
+
+-- queues a compiled score on an oscillator, waiting for room in its queue
+-- as it goes if the score is longer. Returns how many notes were queued
+playScore :: CInt -> NoteBuffer -> IO CSize
+playScore osc (NoteBuffer fp count) =
+        withForeignPtr fp (\p -> c_playOscBatchWait osc p (fromIntegral count))
+
+-- compiles a score and plays it on an oscillator in one go
+playScoreOn :: CInt -> CInt -> Score -> IO CSize
+playScoreOn osc whole score = compileScore whole score >>= playScore osc
+
+-- initializes Synth, failing with an IO error if the device can't be opened
+initSynth :: IO ()
+initSynth = do
+        r <- c_initSynth
+        if r /= 0 then ioError (userError "failed to initialize Synth") else return ()
+
+-- ends an oscillator, waiting for room in its queue first. A score can leave
+-- it full, and endOsc would then drop the END. Returns False if it never fit
+endOscWait :: CInt -> IO Bool
+endOscWait osc = do
+        waitOscSpace osc 1
+        fmap (/= 0) (endOsc osc)
+
+
+
+-- the key of a note name like "C4", "F#4" or "Bb3"
+keyOf :: String -> Maybe Int
+keyOf (letter : more) = do
+        base <- lookup letter [('C', 0), ('D', 2), ('E', 4), ('F', 5), ('G', 7), ('A', 9), ('B', 11)]
+        let (shift, digits) = case more of
+                ('#' : ds) -> (1, ds)
+                ('b' : ds) -> (-1, ds)
+                ds -> (0, ds)
+        octave <- case reads digits of
+                [(o, "")] -> Just o
+                _ -> Nothing
+        let key = 12 * (octave + 1) + base + shift
+        if inRange (bounds pitchTable) key then Just key else Nothing
+keyOf [] = Nothing
+
+-- the duration of a length name: whole, half, quarter, eighth
+durationOf :: String -> Maybe Duration
+durationOf "w" = Just Whole
+durationOf "h" = Just Half
+durationOf "q" = Just Quarter
+durationOf "e" = Just Eighth
+durationOf _ = Nothing
+
 
 -- play a note with a duration value (whole, half, quarter, eigth)
--- The duration of a whole note is defined through wholeNoteDuration, in milliseconds
-play :: String -> String -> CInt -> IO ()
-play note "w" wholeNoteDuration = playNote note wholeNoteDuration
-play note "h" wholeNoteDuration = playNote note (quot wholeNoteDuration 2)
-play note "q" wholeNoteDuration = playNote note (quot wholeNoteDuration 4)
-play note "e" wholeNoteDuration = playNote note (quot wholeNoteDuration 8)
-
-
--- Play a note for a given duration in milliseconds
-playNote :: String -> CInt -> IO ()
-playNote "C4" duration = playOsc 0 duration 261.63
-playNote "D4" duration = playOsc 0 duration 293.66 
-playNote "E4" duration = playOsc 0 duration 329.63 
-playNote "F4" duration = playOsc 0 duration 349.23 
-playNote "G4" duration = playOsc 0 duration 392.00 
-playNote "A4" duration = playOsc 0 duration 440.00 
-playNote "B4" duration = playOsc 0 duration 493.88 
-playNote "C5" duration = playOsc 0 duration 523.25 
-playNote "D5" duration = playOsc 0 duration 587.33 
+-- The duration of a whole note is defined through wholeNoteDuration, in milliseconds.
+-- Returns False if the oscillator's queue was full
+play :: String -> String -> CInt -> IO Bool
+play name len wholeNoteDuration = case durationOf len of
+        Just d -> playNote name (durationMs wholeNoteDuration d)
+        Nothing -> ioError (userError ("unknown note length " ++ len))
+
+
+-- Play a note for a given duration in milliseconds. Returns False if the
+-- oscillator's queue was full
+playNote :: String -> CInt -> IO Bool
+playNote name duration = case keyOf name of
+        Just key -> fmap (/= 0) (playOsc 0 duration (realToFrac (pitchTable ! key)))
+        Nothing -> ioError (userError ("unknown note " ++ name))
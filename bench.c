@@ -0,0 +1,635 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include "synth.h"
+#include "wavetable.h"
+
+// how much audio every render case times, and how many times it's repeated.
+// the fastest run is reported, which keeps the numbers steady between runs
+#define BENCH_FRAMES (44100)
+#define BENCH_RUNS (5)
+#define BENCH_QUEUE (1024)
+
+// the fixed scores of bench -w and bench -c are rendered for CHECK_SECONDS
+// in blocks of CHECK_BLOCK, CHECK_RUNS times. Each is kept as a hash of its
+// samples, a signature of CHECK_SEGMENTS stretches of it, and a time budget.
+// Builds whose SIMD paths round differently can't match the hash, so a
+// signature that's off by no more than CHECK_TOLERANCE for every sample in
+// a stretch is close enough
+#define CHECK_SECONDS (6)
+#define CHECK_RATE (44100)
+#define CHECK_BLOCK (256)
+#define CHECK_RUNS (15)
+#define CHECK_SEGMENTS (64)
+#define CHECK_FEATURES (4 * CHECK_SEGMENTS)
+#define CHECK_TOLERANCE (1e-5)
+// budgets are recorded with this much room over the cost measured
+#define CHECK_BUDGET_SLACK (2.0)
+#define CHECK_LINE (CHECK_FEATURES * 24 + 128)
+
+// a score bench -c renders. threads is the number of render threads, and
+// block_frames is passed on in the config when it isn't 0
+struct check_score {
+    const char *name;
+    unsigned int voices;
+    unsigned int threads;
+    unsigned int block_frames;
+    void (*queue)(synth_t *s);
+};
+
+// what rendering a score gave. The signature holds the sum and the sum of
+// squares of each channel over each stretch, so it changes with the level,
+// timing, sign or side of what's playing, but only a little with rounding
+struct check_result {
+    uint64_t hash;
+    double ms;                      // best render time per second of audio
+    double cost;                    // ms over the best calibration ms
+    double signature[CHECK_FEATURES];
+    int steady;                     // every run gave the same hash
+};
+
+int main(int argc, char **argv);
+double now(void);
+double benchRender(unsigned int voices, size_t block, enum wave_type wave);
+double benchEnqueue(int batch);
+
+// queue the notes of each fixed score
+void queueChord(synth_t *s);
+void queueBuses(synth_t *s);
+void queueNoise(synth_t *s);
+void queueTable(synth_t *s);
+void queueRandom(synth_t *s);
+
+// returns the next number of a 32-bit LCG, the same on every libc
+uint32_t checkRand(uint32_t *state);
+
+// FNV-1a of the samples' bits, little-endian
+uint64_t hashSamples(const float *samples, size_t count);
+
+// fills the signature of frames of stereo samples
+void signSamples(const float *samples, size_t frames, double *signature);
+
+// returns the largest difference between two signatures, per sample of
+// the stretches they were taken over
+double signatureError(const double *a, const double *b);
+
+// returns the time in ms a fixed loop of float math takes to fill frames
+// of stereo out, the way a render would
+double calibrate(float *out, size_t frames);
+
+// renders a score once into frames of out, and sets ms to the time it took
+// per second of audio. returns 0, or -1 if the synth can't be created
+int renderScore(const struct check_score *score, float *out, size_t frames,
+                double *ms);
+
+// renders every score CHECK_RUNS times into results, one per score, timing
+// the calibration loop alongside. returns 0, or -1 if one can't be rendered
+int renderScores(struct check_result *results);
+
+// renders every score and writes the results to path. returns 0, or -1 on
+// error
+int recordScores(const char *path);
+
+// renders every score and compares it with what path recorded, and with
+// its budget too if budgets is set. returns the number of scores that
+// failed, or -1 if path can't be read
+int checkScores(const char *path, int budgets);
+
+// finds the recorded line for name in the lines of path and fills result
+// from it. returns 0, or -1 if there is none
+int readScore(FILE *f, const char *name, struct check_result *result);
+
+static const unsigned int bench_voices[] = { 1, 8, 32, 128 };
+static const size_t bench_blocks[] = { 64, 210, 1024 };
+static const char *wave_names[] = { "sine", "saw", "noise", "pink" };
+static const double bench_rates[] = { 44100, 48000, 96000 };
+
+// the random score again on several threads, which has to give exactly the
+// samples of rendering it on one, and in small blocks, which picks notes up
+// a block at a time. checkScores holds threads to that on any build
+static const struct check_score check_scores[] = {
+    { "chord",    8,  1, 0,  queueChord },
+    { "buses",    8,  1, 0,  queueBuses },
+    { "noise",    2,  1, 0,  queueNoise },
+    { "table",    4,  1, 0,  queueTable },
+    { "random",   32, 1, 0,  queueRandom },
+    { "threads",  32, 3, 0,  queueRandom },
+    { "blocks",   32, 1, 64, queueRandom },
+};
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// returns the best time in ns to render one frame of one voice, with the
+// synth rendering block frames at a time, or -1 if the synth can't be created
+double benchRender(unsigned int voices, size_t block, enum wave_type wave)
+{
+    float *out = malloc(sizeof(float) * 2 * block);
+    struct synth_config config;
+    double best = -1;
+    int run;
+
+    // both the buffer and the blocks inside it, so the sweep changes how
+    // much the engine renders per pass and not just how it's handed out
+    synthDefaultConfig(&config);
+    config.frames_per_buffer = block;
+    config.block_frames = block;
+    config.voices = voices;
+
+    for(run = 0; run < BENCH_RUNS; run++) {
+        synth_t *s = synthCreateOffline(&config);
+        if(s == NULL) {
+            free(out);
+            return -1;
+        }
+
+        // every voice holds one note for longer than the run, at its own pitch
+        unsigned int i;
+        for(i = 0; i < voices; i++) {
+            synthSetOscWave(s, i, wave);
+            synthPlayOsc(s, i, 60000, 110.0 + 7.0 * i);
+        }
+
+        size_t done = 0;
+        double start = now();
+        while(done < BENCH_FRAMES) {
+            synthRender(s, out, block);
+            done += block;
+        }
+        double t = (now() - start) * 1e9 / ((double)done * voices);
+
+        synthDestroyForce(s);
+        if(best < 0 || t < best)
+            best = t;
+    }
+
+    free(out);
+    return best;
+}
+
+// returns the best time in ns to queue one note, one playOsc at a time or
+// as a single playOscBatch, or -1 if the synth can't be created
+double benchEnqueue(int batch)
+{
+    struct note *notes = malloc(sizeof(struct note) * BENCH_QUEUE);
+    double best = -1;
+    int run;
+    unsigned int i;
+
+    for(i = 0; i < BENCH_QUEUE; i++) {
+        notes[i].type = NOTE;
+        notes[i].ms = 100;
+        notes[i].hz = 440;
+    }
+
+    for(run = 0; run < BENCH_RUNS; run++) {
+        setSynthQueueSize(BENCH_QUEUE);
+        if(initSynthOffline(1) != 0) {
+            free(notes);
+            return -1;
+        }
+
+        double start = now();
+        if(batch)
+            playOscBatch(0, notes, BENCH_QUEUE);
+        else
+            for(i = 0; i < BENCH_QUEUE; i++)
+                playOsc(0, 100, 440);
+        double t = (now() - start) * 1e9 / BENCH_QUEUE;
+
+        termSynthOffline();
+        if(best < 0 || t < best)
+            best = t;
+    }
+
+    free(notes);
+    return best;
+}
+
+uint32_t checkRand(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+void queueChord(synth_t *s)
+{
+    static const double chord[] = { 261.63, 329.63, 392.00, 493.88 };
+    unsigned int v, k;
+
+    // held chords under an arpeggio, with envelopes long enough to overlap
+    for(v = 0; v < 8; v++) {
+        int id = synthAllocOsc(s);
+        synthSetOscPan(s, id, (v - 3.5) / 3.5);
+        synthSetOscEnvelope(s, id, 10, 80, 0.6, 120);
+        if(v < 4)
+            for(k = 0; k < 4; k++)
+                synthPlayOsc(s, id, 900, chord[v] * (k % 2 ? 1.5 : 1.0));
+        else {
+            synthRestOsc(s, id, 60 * (v - 4));
+            for(k = 0; k < 24; k++)
+                synthPlayOsc(s, id, 140, 2 * chord[(k + v) % 4]);
+        }
+        synthEndOsc(s, id);
+    }
+}
+
+void queueBuses(synth_t *s)
+{
+    unsigned int v, k;
+
+    for(v = 0; v < 8; v++) {
+        int id = synthAllocOsc(s);
+        synthSetOscWave(s, id, WAVE_SAW);
+        synthSetOscBus(s, id, v % SYNTH_BUSES);
+        synthSetOscGain(s, id, 0.2 + 0.1 * v);
+        for(k = 0; k < 10; k++)
+            synthPlayOsc(s, id, 350, 55.0 * (v + 1) + 20.0 * k);
+        synthEndOsc(s, id);
+    }
+    for(v = 0; v < SYNTH_BUSES; v++)
+        synthSetBusGain(s, v, 1.0 - 0.2 * v);
+    synthSetMasterGain(s, 0.8);
+}
+
+void queueNoise(synth_t *s)
+{
+    unsigned int k;
+    int white = synthAllocOsc(s), pink = synthAllocOsc(s);
+
+    synthSetOscWave(s, white, WAVE_NOISE);
+    synthSetOscWave(s, pink, WAVE_PINK);
+    synthSetOscPan(s, white, -0.5);
+    synthSetOscPan(s, pink, 0.5);
+    for(k = 0; k < 16; k++) {
+        synthPlayOsc(s, k % 2 ? white : pink, 150, 440);
+        synthRestOsc(s, k % 2 ? white : pink, 100);
+    }
+    synthEndOsc(s, white);
+    synthEndOsc(s, pink);
+}
+
+void queueTable(synth_t *s)
+{
+    float cycle[64];
+    unsigned int i, v, k;
+
+    // a square wave, so the higher notes need its upper mip levels
+    for(i = 0; i < 64; i++)
+        cycle[i] = i < 32 ? 0.5f : -0.5f;
+    int table = addWavetable(cycle, 64);
+
+    for(v = 0; v < 4; v++) {
+        int id = synthAllocOsc(s);
+        synthSetOscTable(s, id, table);
+        for(k = 0; k < 12; k++)
+            synthPlayOsc(s, id, 300, 60.0 * (1 << v) * (1 + k / 12.0));
+        synthEndOsc(s, id);
+    }
+}
+
+void queueRandom(synth_t *s)
+{
+    uint32_t state = 7;
+    unsigned int v, k;
+
+    // voices that end part way, and some from the pool through noteOn
+    for(v = 0; v < 24; v++) {
+        int id = synthAllocOsc(s);
+        synthSetOscWave(s, id, v % 3 == 0 ? WAVE_SAW : WAVE_SINE);
+        synthSetOscPan(s, id, (checkRand(&state) % 200) / 100.0 - 1.0);
+        unsigned int n = 5 + checkRand(&state) % 30;
+        for(k = 0; k < n; k++) {
+            if(checkRand(&state) % 4 == 0)
+                synthRestOsc(s, id, 10 + checkRand(&state) % 300);
+            else
+                synthPlayOsc(s, id, 5 + checkRand(&state) % 400,
+                             100 + checkRand(&state) % 900);
+        }
+        synthEndOsc(s, id);
+    }
+    for(k = 0; k < 6; k++)
+        synthNoteOn(s, 200 + 50 * k, 500 + 300 * k, 0.5);
+}
+
+uint64_t hashSamples(const float *samples, size_t count)
+{
+    uint64_t h = 14695981039346656037ull;
+    size_t i;
+    int b;
+
+    for(i = 0; i < count; i++) {
+        uint32_t v;
+        memcpy(&v, &samples[i], 4);
+        for(b = 0; b < 32; b += 8) {
+            h ^= (v >> b) & 0xff;
+            h *= 1099511628211ull;
+        }
+    }
+    return h;
+}
+
+void signSamples(const float *samples, size_t frames, double *signature)
+{
+    size_t per = frames / CHECK_SEGMENTS;
+    unsigned int seg, c;
+    size_t i;
+
+    for(seg = 0; seg < CHECK_SEGMENTS; seg++)
+    for(c = 0; c < 2; c++) {
+        double sum = 0, squares = 0;
+        for(i = seg * per; i < (seg + 1) * per; i++) {
+            double x = samples[2 * i + c];
+            sum += x;
+            squares += x * x;
+        }
+        signature[4 * seg + 2 * c] = sum;
+        signature[4 * seg + 2 * c + 1] = squares;
+    }
+}
+
+double signatureError(const double *a, const double *b)
+{
+    double worst = 0;
+    unsigned int i;
+
+    for(i = 0; i < CHECK_FEATURES; i++)
+        if(fabs(a[i] - b[i]) > worst)
+            worst = fabs(a[i] - b[i]);
+    return worst / (CHECK_SECONDS * CHECK_RATE / CHECK_SEGMENTS);
+}
+
+double calibrate(float *out, size_t frames)
+{
+    // resonators that ring on forever, so none of it can be folded away,
+    // written out like voices mixed into a buffer
+    float y[8], prev[8];
+    size_t i;
+    unsigned int k;
+
+    for(k = 0; k < 8; k++) {
+        y[k] = 0.5f;
+        prev[k] = 0;
+    }
+    double start = now();
+    for(i = 0; i < frames; i++) {
+        for(k = 0; k < 8; k++) {
+            float next = 1.99f * y[k] - prev[k];
+            prev[k] = y[k];
+            y[k] = next;
+        }
+        out[2 * i] = y[0] + y[2] + y[4] + y[6];
+        out[2 * i + 1] = y[1] + y[3] + y[5] + y[7];
+    }
+    return (now() - start) * 1e3 * CHECK_RATE / frames;
+}
+
+int renderScore(const struct check_score *score, float *out, size_t frames,
+                double *ms)
+{
+    struct synth_config config;
+
+    synthDefaultConfig(&config);
+    config.sample_rate = CHECK_RATE;
+    config.frames_per_buffer = CHECK_BLOCK;
+    config.block_frames = score->block_frames;
+    config.voices = score->voices;
+    config.queue_size = 64;
+
+    synth_t *s = synthCreateOffline(&config);
+    if(s == NULL)
+        return -1;
+    synthSetThreads(s, score->threads);
+    score->queue(s);
+
+    double start = now();
+    synthRender(s, out, frames);
+    *ms = (now() - start) * 1e3 * CHECK_RATE / frames;
+    synthDestroyForce(s);
+    return 0;
+}
+
+int renderScores(struct check_result *results)
+{
+    unsigned int count = sizeof(check_scores) / sizeof(check_scores[0]);
+    size_t frames = CHECK_SECONDS * CHECK_RATE;
+    float *out = malloc(sizeof(float) * 2 * frames);
+    double calibration = -1;
+    unsigned int i;
+    int run;
+
+    for(i = 0; i < count; i++) {
+        results[i].ms = -1;
+        results[i].steady = 1;
+    }
+
+    // every run renders each score once, so the best time of a score comes
+    // from anywhere in the whole check rather than from one moment of it.
+    // The calibration loop is timed every run too, so a machine that runs
+    // slower for a while slows both
+    for(run = 0; run < CHECK_RUNS; run++) {
+        double c = calibrate(out, frames);
+        if(calibration < 0 || c < calibration)
+            calibration = c;
+
+        for(i = 0; i < count; i++) {
+            struct check_result *r = &results[i];
+            double ms;
+            if(renderScore(&check_scores[i], out, frames, &ms) != 0) {
+                printf("Failed to render %s\n", check_scores[i].name);
+                free(out);
+                return -1;
+            }
+
+            uint64_t hash = hashSamples(out, 2 * frames);
+            if(run == 0)
+                r->hash = hash;
+            else if(hash != r->hash)
+                r->steady = 0;
+            if(r->ms < 0 || ms < r->ms)
+                r->ms = ms;
+            // the last run's, which is as good as any once they're steady
+            if(run == CHECK_RUNS - 1)
+                signSamples(out, frames, r->signature);
+        }
+    }
+
+    for(i = 0; i < count; i++)
+        results[i].cost = results[i].ms / calibration;
+    free(out);
+    return 0;
+}
+
+int recordScores(const char *path)
+{
+    struct check_result results[sizeof(check_scores) / sizeof(check_scores[0])];
+    unsigned int i, k;
+
+    if(renderScores(results) != 0)
+        return -1;
+
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        printf("Failed to create %s\n", path);
+        return -1;
+    }
+    fprintf(f, "# score hash budget signature...\n");
+    fprintf(f, "# the budget is the render time per second of audio over the time\n");
+    fprintf(f, "# of a calibration loop. The signature is the sum and the sum of\n");
+    fprintf(f, "# squares of the left, then the right channel over %d stretches\n",
+        CHECK_SEGMENTS);
+    for(i = 0; i < sizeof(check_scores) / sizeof(check_scores[0]); i++) {
+        struct check_result *r = &results[i];
+        if(!r->steady)
+            printf("%s doesn't render the same twice\n", check_scores[i].name);
+
+        fprintf(f, "%s %016llx %.4f", check_scores[i].name,
+            (unsigned long long)r->hash, r->cost * CHECK_BUDGET_SLACK);
+        for(k = 0; k < CHECK_FEATURES; k++)
+            fprintf(f, " %.17g", r->signature[k]);
+        fprintf(f, "\n");
+        printf("%-8s %016llx %8.3f ms/s, cost %8.4f\n", check_scores[i].name,
+            (unsigned long long)r->hash, r->ms, r->cost);
+    }
+    if(fclose(f) != 0) {
+        printf("Failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int readScore(FILE *f, const char *name, struct check_result *result)
+{
+    char line[CHECK_LINE];
+    size_t len = strlen(name);
+
+    rewind(f);
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(strncmp(line, name, len) != 0 || line[len] != ' ')
+            continue;
+
+        char *p = line + len;
+        unsigned int k;
+        result->hash = strtoull(p, &p, 16);
+        result->cost = strtod(p, &p);
+        for(k = 0; k < CHECK_FEATURES; k++) {
+            char *end;
+            result->signature[k] = strtod(p, &end);
+            if(end == p)
+                return -1;
+            p = end;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int checkScores(const char *path, int budgets)
+{
+    struct check_result results[sizeof(check_scores) / sizeof(check_scores[0])];
+    FILE *f = fopen(path, "r");
+    unsigned int i;
+    int failed = 0;
+    uint64_t random_hash = 0;
+    int have_random = 0;
+
+    if(f == NULL) {
+        printf("Failed to open %s\n", path);
+        return -1;
+    }
+    if(renderScores(results) != 0) {
+        fclose(f);
+        return -1;
+    }
+    for(i = 0; i < sizeof(check_scores) / sizeof(check_scores[0]); i++) {
+        const char *name = check_scores[i].name;
+        struct check_result want, got = results[i];
+
+        if(strcmp(name, "random") == 0) {
+            random_hash = got.hash;
+            have_random = 1;
+        }
+        if(readScore(f, name, &want) != 0) {
+            printf("%-8s FAIL not recorded in %s\n", name, path);
+            failed++;
+            continue;
+        }
+
+        // the samples first, then the time they took
+        const char *verdict = "ok";
+        int ok = 1;
+        double error = signatureError(got.signature, want.signature);
+        if(!got.steady) {
+            verdict = "FAIL renders differently every time";
+            ok = 0;
+        } else if(strcmp(name, "threads") == 0 &&
+                  (!have_random || got.hash != random_hash)) {
+            verdict = "FAIL differs from random";
+            ok = 0;
+        } else if(got.hash != want.hash) {
+            verdict = "close";
+            if(error > CHECK_TOLERANCE) {
+                verdict = "FAIL output changed";
+                ok = 0;
+            }
+        }
+        // budgets only hold on machines like the one that recorded them
+        if(ok && budgets && got.cost > want.cost) {
+            verdict = "FAIL over budget";
+            ok = 0;
+        }
+        if(!ok)
+            failed++;
+        printf("%-8s %016llx %8.3f ms/s, cost %8.4f of %8.4f, off by %-8.2g %s\n",
+            name, (unsigned long long)got.hash, got.ms, got.cost, want.cost,
+            error, verdict);
+    }
+    fclose(f);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int v, b, w, r;
+
+    // bench -w file records the fixed scores, bench -c file checks their
+    // output and bench -t file their budgets as well
+    if(argc == 3 && strcmp(argv[1], "-w") == 0)
+        return recordScores(argv[2]) == 0 ? 0 : 1;
+    if(argc == 3 && (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "-t") == 0)) {
+        int failed = checkScores(argv[2], strcmp(argv[1], "-t") == 0);
+        if(failed > 0)
+            printf("%d of %zu scores failed\n", failed,
+                sizeof(check_scores) / sizeof(check_scores[0]));
+        return failed == 0 ? 0 : 1;
+    }
+
+    printf("%-6s %6s %6s %12s", "wave", "voices", "block", "ns/sample");
+    for(r = 0; r < sizeof(bench_rates) / sizeof(bench_rates[0]); r++)
+        printf(" %9.0fHz", bench_rates[r]);
+    printf("\n");
+
+    for(w = 0; w < sizeof(wave_names) / sizeof(wave_names[0]); w++)
+    for(v = 0; v < sizeof(bench_voices) / sizeof(bench_voices[0]); v++)
+    for(b = 0; b < sizeof(bench_blocks) / sizeof(bench_blocks[0]); b++) {
+        double ns = benchRender(bench_voices[v], bench_blocks[b], w);
+        printf("%-6s %6u %6zu %12.2f", wave_names[w], bench_voices[v],
+            bench_blocks[b], ns);
+        // how many voices one core keeps up with in real time
+        for(r = 0; r < sizeof(bench_rates) / sizeof(bench_rates[0]); r++)
+            printf(" %11.0f", 1e9 / (ns * bench_rates[r]));
+        printf("\n");
+    }
+
+    printf("\n");
+    printf("playOsc      %8.2f ns/note\n", benchEnqueue(0));
+    printf("playOscBatch %8.2f ns/note\n", benchEnqueue(1));
+    return 0;
+}
@@ -3,7 +3,7 @@
 #include <unistd.h>
 #include "synth.h"
 
-int main(void);
+int main(int argc, char **argv);
 void playArp(void);
 
 void playArp(void)
@@ -31,9 +31,23 @@ void playArp(void)
     endOsc(1);    
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
-    initSynth();
+    // given a file name, render the arpeggio there instead of playing it
+    if(argc > 1) {
+        if(initSynthOffline(2) != 0)
+            return 1;
+        playArp();
+        long frames = renderSynthToFile(argv[1], 0);
+        termSynthOffline();
+        if(frames < 0)
+            return 1;
+        printf("Rendered %ld frames to %s\n", frames, argv[1]);
+        return 0;
+    }
+
+    if(initSynth() != 0)
+        return 1;
     playArp();
     sleep(10);
     termSynth();
@@ -0,0 +1,40 @@
+#include <stdio.h>
+
+#include "wavetable.h"
+
+/*
+ * Prints the built-in wave tables as C source. It's built with
+ * SYNTH_COMPUTE_TABLES, so wavetable.c computes them the way it would at
+ * startup, and the floats are printed in hex so tables.c holds exactly the
+ * same bits.
+ */
+
+int main(void);
+
+// prints w as the definition of a constant struct wave called name
+void printWave(const char *name, const char *type, const struct wave *w);
+
+void printWave(const char *name, const char *type, const struct wave *w)
+{
+    unsigned int level, i;
+
+    printf("const struct wave %s = { %s, %u, {\n", name, type, w->levels);
+    for(level = 0; level < w->levels; level++) {
+        printf("    {");
+        for(i = 0; i <= TABLE_SIZE; i++)
+            printf("%s%af%s", i % 4 == 0 ? "\n        " : " ",
+                   w->table[level][i], i < TABLE_SIZE ? "," : "");
+        printf("\n    }%s\n", level + 1 < w->levels ? "," : "");
+    }
+    printf("} };\n");
+}
+
+int main(void)
+{
+    printf("// generated by gentables from wavetable.c, don't edit\n");
+    printf("#include \"wavetable.h\"\n\n");
+    printWave("sine_wave", "WAVE_SINE", wavetableGet(WAVE_SINE));
+    printf("\n");
+    printWave("saw_wave", "WAVE_SAW", wavetableGet(WAVE_SAW));
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include "kernels.h"
+
+// keeps the pink filter's peaks inside [-1, 1]
+#define PINK_GAIN (0.11f)
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+void kernelLookup(float *dst, const float *table, unsigned int bits,
+                  uint32_t *phase, uint32_t inc, unsigned long frames)
+{
+    // every frame's phase is a multiply away from the first, so frames
+    // don't depend on each other. The weight is the 23 bits below the index
+    uint32_t ph = *phase;
+    unsigned long i = 0;
+
+#if defined(__AVX2__)
+    // 8 frames per iteration
+    __m256i p = _mm256_add_epi32(_mm256_set1_epi32(ph),
+        _mm256_mullo_epi32(_mm256_set1_epi32(inc),
+            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+    __m256i step = _mm256_set1_epi32(inc * 8);
+    __m128i shift = _mm_cvtsi32_si128(32 - bits);
+    __m128i up = _mm_cvtsi32_si128(bits);
+    __m256 weight = _mm256_set1_ps(1.0f / (1 << 23));
+    for(; i + 8 <= frames; i += 8) {
+        __m256i idx = _mm256_srl_epi32(p, shift);
+        __m256 f = _mm256_mul_ps(weight, _mm256_cvtepi32_ps(
+            _mm256_srli_epi32(_mm256_sll_epi32(p, up), 9)));
+        __m256 a = _mm256_i32gather_ps(table, idx, 4);
+        __m256 b = _mm256_i32gather_ps(table + 1, idx, 4);
+        _mm256_storeu_ps(dst + i,
+            _mm256_add_ps(a, _mm256_mul_ps(f, _mm256_sub_ps(b, a))));
+        p = _mm256_add_epi32(p, step);
+    }
+    ph += inc * (uint32_t)i;
+#endif
+
+    for(; i < frames; i++) {
+        uint32_t idx = ph >> (32 - bits);
+        float f = (float)((ph << bits) >> 9) * (1.0f / (1 << 23));
+        dst[i] = table[idx] + f * (table[idx + 1] - table[idx]);
+        ph += inc;
+    }
+
+    *phase = ph;
+}
+
+void kernelWhiteNoise(float *dst, uint32_t *state, unsigned long frames)
+{
+    unsigned long i = 0;
+    int l;
+
+#if defined(__AVX2__)
+    // one iteration steps all 8 lanes once
+    __m256i x = _mm256_loadu_si256((const __m256i *)state);
+    __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    for(; i + NOISE_LANES <= frames; i += NOISE_LANES) {
+        x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+        x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+        x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+    }
+    _mm256_storeu_si256((__m256i *)state, x);
+#endif
+
+    // the lanes step in the same order without SIMD, so the output matches.
+    // whole groups of lanes first, which the compiler can vectorize itself
+    for(; i + NOISE_LANES <= frames; i += NOISE_LANES) {
+        for(l = 0; l < NOISE_LANES; l++) {
+            uint32_t x = state[l];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            state[l] = x;
+            dst[i + l] = (float)(int32_t)x * (1.0f / 2147483648.0f);
+        }
+    }
+    for(l = 0; i < frames; i++, l++) {
+        uint32_t x = state[l];
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        state[l] = x;
+        dst[i] = (float)(int32_t)x * (1.0f / 2147483648.0f);
+    }
+}
+
+void kernelPinkNoise(float *dst, uint32_t *state, float *pink,
+                     unsigned long frames)
+{
+    float b0 = pink[0];
+    float b1 = pink[1];
+    float b2 = pink[2];
+    unsigned long i;
+
+    // white noise first, then Paul Kellet's three pole filter over it
+    kernelWhiteNoise(dst, state, frames);
+    for(i = 0; i < frames; i++) {
+        float w = dst[i];
+        b0 = 0.99765f * b0 + w * 0.0990460f;
+        b1 = 0.96300f * b1 + w * 0.2965164f;
+        b2 = 0.57000f * b2 + w * 1.0526913f;
+        dst[i] = (b0 + b1 + b2 + w * 0.1848f) * PINK_GAIN;
+    }
+
+    pink[0] = b0;
+    pink[1] = b1;
+    pink[2] = b2;
+}
+
+void kernelRamp(float *buf, unsigned long frames, float gain, float step)
+{
+    unsigned long i = 0;
+
+#if defined(__AVX__)
+    // 8 frames per iteration
+    __m256 g0 = _mm256_set1_ps(gain);
+    __m256 dg = _mm256_set1_ps(step);
+    __m256 idx = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 eight = _mm256_set1_ps(8);
+    for(; i + 8 <= frames; i += 8) {
+        __m256 g = _mm256_add_ps(g0, _mm256_mul_ps(dg, idx));
+        __m256 s = _mm256_loadu_ps(buf + i);
+        _mm256_storeu_ps(buf + i, _mm256_mul_ps(s, g));
+        idx = _mm256_add_ps(idx, eight);
+    }
+#elif defined(__SSE__)
+    // 4 frames per iteration
+    __m128 g0 = _mm_set1_ps(gain);
+    __m128 dg = _mm_set1_ps(step);
+    __m128 idx = _mm_setr_ps(0, 1, 2, 3);
+    __m128 four = _mm_set1_ps(4);
+    for(; i + 4 <= frames; i += 4) {
+        __m128 g = _mm_add_ps(g0, _mm_mul_ps(dg, idx));
+        __m128 s = _mm_loadu_ps(buf + i);
+        _mm_storeu_ps(buf + i, _mm_mul_ps(s, g));
+        idx = _mm_add_ps(idx, four);
+    }
+#elif defined(__ARM_NEON)
+    // 4 frames per iteration
+    static const float lanes[4] = { 0, 1, 2, 3 };
+    float32x4_t g0 = vdupq_n_f32(gain);
+    float32x4_t dg = vdupq_n_f32(step);
+    float32x4_t idx = vld1q_f32(lanes);
+    float32x4_t four = vdupq_n_f32(4);
+    for(; i + 4 <= frames; i += 4) {
+        float32x4_t g = vaddq_f32(g0, vmulq_f32(dg, idx));
+        float32x4_t s = vld1q_f32(buf + i);
+        vst1q_f32(buf + i, vmulq_f32(s, g));
+        idx = vaddq_f32(idx, four);
+    }
+#endif
+
+    // whatever is left over (or everything, without SIMD)
+    for(; i < frames; i++)
+        buf[i] *= gain + step * (float)i;
+}
+
+void kernelMix(float *dst, const float *src, unsigned long frames,
+               float left, float right, float step_left, float step_right)
+{
+    unsigned long i = 0;
+
+#if defined(__AVX__)
+    // 4 frames per iteration, each source sample spread over left and right
+    __m256 c0 = _mm256_setr_ps(left, right, left, right, left, right, left, right);
+    __m256 dc = _mm256_setr_ps(step_left, step_right, step_left, step_right,
+                               step_left, step_right, step_left, step_right);
+    __m256 idx = _mm256_setr_ps(0, 0, 1, 1, 2, 2, 3, 3);
+    __m256 four = _mm256_set1_ps(4);
+    for(; i + 4 <= frames; i += 4) {
+        __m128 m = _mm_loadu_ps(src + i);
+        __m256 s = _mm256_insertf128_ps(_mm256_castps128_ps256(
+            _mm_unpacklo_ps(m, m)), _mm_unpackhi_ps(m, m), 1);
+        __m256 c = _mm256_add_ps(c0, _mm256_mul_ps(dc, idx));
+        __m256 d = _mm256_loadu_ps(dst + 2 * i);
+        _mm256_storeu_ps(dst + 2 * i, _mm256_add_ps(d, _mm256_mul_ps(s, c)));
+        idx = _mm256_add_ps(idx, four);
+    }
+#elif defined(__SSE__)
+    // 4 frames per iteration, in two stores of two frames
+    __m128 c0 = _mm_setr_ps(left, right, left, right);
+    __m128 dc = _mm_setr_ps(step_left, step_right, step_left, step_right);
+    __m128 idx = _mm_setr_ps(0, 0, 1, 1);
+    __m128 two = _mm_set1_ps(2);
+    for(; i + 4 <= frames; i += 4) {
+        __m128 m = _mm_loadu_ps(src + i);
+        __m128 c = _mm_add_ps(c0, _mm_mul_ps(dc, idx));
+        __m128 d = _mm_loadu_ps(dst + 2 * i);
+        _mm_storeu_ps(dst + 2 * i, _mm_add_ps(d, _mm_mul_ps(_mm_unpacklo_ps(m, m), c)));
+        idx = _mm_add_ps(idx, two);
+        c = _mm_add_ps(c0, _mm_mul_ps(dc, idx));
+        d = _mm_loadu_ps(dst + 2 * i + 4);
+        _mm_storeu_ps(dst + 2 * i + 4, _mm_add_ps(d, _mm_mul_ps(_mm_unpackhi_ps(m, m), c)));
+        idx = _mm_add_ps(idx, two);
+    }
+#elif defined(__ARM_NEON)
+    // 4 frames per iteration, in two stores of two frames
+    static const float lanes[4] = { 0, 0, 1, 1 };
+    float32x4_t c0 = { left, right, left, right };
+    float32x4_t dc = { step_left, step_right, step_left, step_right };
+    float32x4_t idx = vld1q_f32(lanes);
+    float32x4_t two = vdupq_n_f32(2);
+    for(; i + 4 <= frames; i += 4) {
+        float32x4x2_t m = vzipq_f32(vld1q_f32(src + i), vld1q_f32(src + i));
+        float32x4_t c = vaddq_f32(c0, vmulq_f32(dc, idx));
+        float32x4_t d = vld1q_f32(dst + 2 * i);
+        vst1q_f32(dst + 2 * i, vaddq_f32(d, vmulq_f32(m.val[0], c)));
+        idx = vaddq_f32(idx, two);
+        c = vaddq_f32(c0, vmulq_f32(dc, idx));
+        d = vld1q_f32(dst + 2 * i + 4);
+        vst1q_f32(dst + 2 * i + 4, vaddq_f32(d, vmulq_f32(m.val[1], c)));
+        idx = vaddq_f32(idx, two);
+    }
+#endif
+
+    for(; i < frames; i++) {
+        dst[2 * i] += src[i] * (left + step_left * (float)i);
+        dst[2 * i + 1] += src[i] * (right + step_right * (float)i);
+    }
+}
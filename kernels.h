@@ -0,0 +1,47 @@
+#ifndef _KERNELS_
+#define _KERNELS_
+
+#include <stdint.h>
+
+/*
+ * Block kernels used by the render path in synth.c.
+ *
+ * Oscillators are rendered into mono blocks of `frames` samples, and
+ * kernelMix places each one in the interleaved stereo mix (left, right,
+ * left, ...).  The gain and mix steps have SSE, AVX and NEON versions which
+ * are picked at compile time; build with -mavx (or -march=native) to get
+ * the wider ones.  The lookup has an AVX2 version using gathers, for -mavx2.
+ */
+
+// fills dst with frames of linearly interpolated lookups
+// into a table of 1 << bits entries, plus a guard entry copying the first.
+// phase is a 32-bit fraction of the table, so it wraps by itself; its top
+// bits are the index and the rest the interpolation weight. It moves by inc
+// every frame
+void kernelLookup(float *dst, const float *table, unsigned int bits,
+                  uint32_t *phase, uint32_t inc, unsigned long frames);
+
+// number of independent xorshift generators a noise state holds. Frame i
+// comes from lane i % NOISE_LANES, so a block's lanes advance side by side
+#define NOISE_LANES (8)
+
+// fills dst with frames of white noise in [-1, 1), drawn
+// from the NOISE_LANES xorshift32 states in state. None of them may be 0
+void kernelWhiteNoise(float *dst, uint32_t *state, unsigned long frames);
+
+// the same, filtered down 3 dB per octave into pink noise. pink holds the
+// three filter states, carried from block to block
+void kernelPinkNoise(float *dst, uint32_t *state, float *pink,
+                     unsigned long frames);
+
+// multiplies frames of buf by a gain that starts at `gain` on the first
+// frame and moves by `step` every frame after that
+void kernelRamp(float *buf, unsigned long frames, float gain, float step);
+
+// adds the mono block src into the stereo block dst, scaled by a gain per
+// channel that starts at left and right and moves by step_left and
+// step_right every frame
+void kernelMix(float *dst, const float *src, unsigned long frames,
+               float left, float right, float step_left, float step_right);
+
+#endif
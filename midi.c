@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "midi.h"
+
+#define MIDI_DRUM_CHANNEL (9)
+#define MIDI_DEFAULT_TEMPO (500000)     // microseconds per quarter note, 120 bpm
+
+// reads big-endian numbers at p
+uint32_t getBE16(const unsigned char *p);
+uint32_t getBE32(const unsigned char *p);
+
+// reads a variable-length quantity, moving p past it. returns 0 if it
+// doesn't end before end
+int readVarLen(const unsigned char **p, const unsigned char *end, uint32_t *v);
+
+// reads the next event of a track into ev. returns 0 at the end of the
+// track, or where it stops making sense, and keeps returning 0 after that
+int midiRead(struct midi_reader *r, struct midi_event *ev);
+int midiParse(struct midi_reader *r, struct midi_event *ev);
+
+// handles the next event of the track. returns 0 at its end
+int trackStep(struct midi_track *t);
+
+// start and stop the note on key, channel * 128 + note, in the lane
+// assignment. velocity is 1 to 127
+void trackNoteOn(struct midi_track *t, unsigned int key, unsigned int velocity);
+void trackNoteOff(struct midi_track *t, unsigned int key);
+
+// adds the tempo change of ev at the track's tick to its collected map.
+// returns 0, or -1 if there's no memory for it
+int collectTempo(struct midi_track *t, const struct midi_event *ev);
+
+// hands a finished note to the lane. returns 0, or -1 if there's no memory
+// for it
+int lanePush(struct midi_lane *l, const struct midi_note *n);
+
+// returns the time of tick in ms, moving the tempo map on to it. ticks
+// must never go backwards
+uint64_t tickMs(struct midi_track *t, uint64_t tick);
+
+// reads through a track once, counting its lanes and, if collect is set,
+// collecting its tempo map. returns 0, or -1 if there's no memory
+int scanTrack(struct midi_track *t, int collect);
+
+uint32_t getBE16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+uint32_t getBE32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+int readVarLen(const unsigned char **p, const unsigned char *end, uint32_t *v)
+{
+    uint32_t x = 0;
+    int i;
+
+    // at most four bytes of seven bits
+    for(i = 0; i < 4 && *p < end; i++) {
+        unsigned char b = *(*p)++;
+        x = (x << 7) | (b & 0x7f);
+        if(!(b & 0x80)) {
+            *v = x;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int midiRead(struct midi_reader *r, struct midi_event *ev)
+{
+    if(midiParse(r, ev))
+        return 1;
+    r->p = r->end;
+    return 0;
+}
+
+int midiParse(struct midi_reader *r, struct midi_event *ev)
+{
+    uint32_t delta;
+
+    if(!readVarLen(&r->p, r->end, &delta) || r->p >= r->end)
+        return 0;
+    r->tick += delta;
+
+    // a data byte where the status should be repeats the last status
+    unsigned char status = *r->p;
+    if(status & 0x80)
+        r->p++;
+    else if(r->status)
+        status = r->status;
+    else
+        return 0;
+    ev->status = status;
+    ev->type = 0;
+
+    if(status == 0xFF) {
+        if(r->p >= r->end)
+            return 0;
+        ev->type = *r->p++;
+        if(!readVarLen(&r->p, r->end, &ev->len))
+            return 0;
+        r->status = 0;
+        if(ev->type == 0x2F)
+            return 0;
+    }
+    else if(status == 0xF0 || status == 0xF7) {
+        if(!readVarLen(&r->p, r->end, &ev->len))
+            return 0;
+        r->status = 0;
+    }
+    else if(status > 0xF0)
+        return 0;
+    else {
+        // program change and channel pressure have one data byte
+        ev->len = (status & 0xE0) == 0xC0 ? 1 : 2;
+        r->status = status;
+    }
+
+    if(ev->len > (uint32_t)(r->end - r->p))
+        return 0;
+    ev->data = r->p;
+    r->p += ev->len;
+    return 1;
+}
+
+uint64_t tickMs(struct midi_track *t, uint64_t tick)
+{
+    double us;
+
+    if(t->smpte_us > 0)
+        us = tick * t->smpte_us;
+    else {
+        // move on to the last change at or before tick
+        while(t->tempo_at + 1 < t->num_tempo && t->tempo[t->tempo_at + 1].tick <= tick)
+            t->tempo_at++;
+        const struct midi_tempo *m = &t->tempo[t->tempo_at];
+        us = m->us + (double)(tick - m->tick) * m->us_per_quarter / t->division;
+    }
+
+    // rounding absolute times keeps durations from drifting
+    return (uint64_t)(us / 1000 + 0.5);
+}
+
+int collectTempo(struct midi_track *t, const struct midi_event *ev)
+{
+    const struct midi_tempo *last = &t->collect[t->num_collect - 1];
+    uint64_t tick = t->reader.tick;
+
+    // the map doubles whenever its count reaches a power of two
+    if((t->num_collect & (t->num_collect - 1)) == 0) {
+        struct midi_tempo *grown = realloc(t->collect,
+            sizeof(struct midi_tempo) * 2 * t->num_collect);
+        if(grown == NULL)
+            return -1;
+        t->collect = grown;
+        last = &t->collect[t->num_collect - 1];
+    }
+
+    struct midi_tempo *m = &t->collect[t->num_collect++];
+    m->tick = tick;
+    m->us = last->us + (double)(tick - last->tick) * last->us_per_quarter / t->division;
+    m->us_per_quarter = (ev->data[0] << 16) | (ev->data[1] << 8) | ev->data[2];
+    return 0;
+}
+
+int lanePush(struct midi_lane *l, const struct midi_note *n)
+{
+    if(l->count == l->size) {
+        unsigned int size = l->size > 0 ? 2 * l->size : 16;
+        struct midi_note *grown = malloc(sizeof(struct midi_note) * size);
+        unsigned int i;
+        if(grown == NULL)
+            return -1;
+        // unwrap the ring into the new one
+        for(i = 0; i < l->count; i++)
+            grown[i] = l->notes[(l->head + i) % l->size];
+        free(l->notes);
+        l->notes = grown;
+        l->head = 0;
+        l->size = size;
+    }
+    l->notes[(l->head + l->count++) % l->size] = *n;
+    return 0;
+}
+
+void trackNoteOn(struct midi_track *t, unsigned int key, unsigned int velocity)
+{
+    unsigned int i = 0;
+
+    while(i < t->num_lanes && t->busy[i])
+        i++;
+    if(i == t->num_lanes)
+        return;
+
+    t->busy[i] = 1;
+    t->keys[key] = i + 1;
+    if(i + 1 > t->max_lanes)
+        t->max_lanes = i + 1;
+
+    if(t->lanes != NULL) {
+        struct midi_lane *l = &t->lanes[i];
+        l->cur_start = tickMs(t, t->reader.tick);
+        l->cur_hz = 440 * pow(2, ((int)(key % 128) - 69) / 12.0);
+        l->cur_gain = velocity / 127.0f;
+    }
+}
+
+void trackNoteOff(struct midi_track *t, unsigned int key)
+{
+    unsigned int i = t->keys[key] - 1;
+
+    t->busy[i] = 0;
+    t->keys[key] = 0;
+
+    if(t->lanes != NULL) {
+        struct midi_lane *l = &t->lanes[i];
+        struct midi_note n;
+        n.start = l->cur_start;
+        n.end = tickMs(t, t->reader.tick);
+        n.hz = l->cur_hz;
+        n.gain = l->cur_gain;
+        // without room the note is left out, and the lane rests instead
+        if(lanePush(l, &n) != 0)
+            printf("Out of memory for MIDI notes, dropping one\n");
+    }
+}
+
+int trackStep(struct midi_track *t)
+{
+    struct midi_event ev;
+    unsigned int key;
+
+    if(t->done)
+        return 0;
+
+    if(!midiRead(&t->reader, &ev)) {
+        // whatever is still sounding stops where the track does
+        for(key = 0; key < MIDI_KEYS; key++) {
+            if(t->keys[key])
+                trackNoteOff(t, key);
+        }
+        t->done = 1;
+        return 0;
+    }
+
+    if(t->collect != NULL && ev.status == 0xFF && ev.type == 0x51 && ev.len == 3) {
+        if(collectTempo(t, &ev) != 0) {
+            t->done = 1;
+            return -1;
+        }
+        return 1;
+    }
+
+    unsigned int kind = ev.status & 0xF0;
+    unsigned int channel = ev.status & 0x0F;
+
+    // the drum channel has no pitch to play
+    if(ev.status >= 0xF0 || channel == MIDI_DRUM_CHANNEL ||
+       (kind != 0x80 && kind != 0x90))
+        return 1;
+
+    // a note-on for a key that's already down starts it over
+    key = channel * 128 + (ev.data[0] & 0x7f);
+    if(t->keys[key])
+        trackNoteOff(t, key);
+    if(kind == 0x90 && (ev.data[1] & 0x7f) > 0)
+        trackNoteOn(t, key, ev.data[1] & 0x7f);
+    return 1;
+}
+
+int midiNext(struct midi_lane *l, struct score_event *e, float *gain)
+{
+    // the track is read on until this lane has a note, handing the other
+    // lanes theirs on the way
+    while(l->count == 0 && !l->track->done)
+        trackStep(l->track);
+    if(l->count == 0)
+        return 0;
+
+    const struct midi_note *n = &l->notes[l->head];
+    *gain = n->gain;
+
+    // the gap since the lane's last note is a rest
+    if(n->start > l->emitted) {
+        e->ms = n->start - l->emitted;
+        e->hz = 0;
+        l->emitted = n->start;
+        return 1;
+    }
+
+    e->ms = n->end - n->start;
+    e->hz = n->hz;
+    l->emitted = n->end;
+    l->head = (l->head + 1) % l->size;
+    l->count--;
+    return 1;
+}
+
+int scanTrack(struct midi_track *t, int collect)
+{
+    int r;
+
+    if(collect) {
+        t->collect = malloc(sizeof(struct midi_tempo));
+        if(t->collect == NULL)
+            return -1;
+        t->collect[0].tick = 0;
+        t->collect[0].us = 0;
+        t->collect[0].us_per_quarter = MIDI_DEFAULT_TEMPO;
+        t->num_collect = 1;
+    }
+
+    while((r = trackStep(t)) > 0)
+        ;
+    return r;
+}
+
+int midiOpen(struct score *score)
+{
+    const unsigned char *p = score->map;
+    const unsigned char *end = p + score->size;
+    unsigned int t, i, n = 0, total = 0;
+    unsigned int division;
+    double smpte_us = 0;
+
+    if(score->size < 14 || memcmp(p, "MThd", 4) != 0)
+        return -1;
+    uint32_t len = getBE32(p + 4);
+    if(len < 6 || len > score->size - 8)
+        return -1;
+    unsigned int format = getBE16(p + 8);
+    unsigned int ntrks = getBE16(p + 10);
+    division = getBE16(p + 12);
+
+    if(division & 0x8000) {
+        // frames per second and ticks per frame. 29 stands for 29.97
+        int fps = -(signed char)(division >> 8);
+        unsigned int tpf = division & 0xff;
+        if(fps <= 0 || tpf == 0)
+            return -1;
+        smpte_us = 1e6 / ((fps == 29 ? 29.97 : fps) * tpf);
+    }
+    else if(division == 0)
+        return -1;
+
+    struct midi_file *midi = calloc(1, sizeof(struct midi_file));
+    if(midi == NULL)
+        return -1;
+    midi->tracks = calloc(ntrks > 0 ? ntrks : 1, sizeof(struct midi_track));
+    midi->tempo_maps = calloc(ntrks > 0 ? ntrks : 1, sizeof(struct midi_tempo*));
+    score->midi = midi;
+    if(midi->tracks == NULL || midi->tempo_maps == NULL) {
+        midiClose(score);
+        return -1;
+    }
+
+    // find the track chunks, skipping any others
+    p += 8 + len;
+    while(n < ntrks && end - p >= 8) {
+        uint32_t size = getBE32(p + 4);
+        const unsigned char *data = p + 8;
+
+        // a truncated file plays as far as it goes
+        if(size > (uint32_t)(end - data))
+            size = end - data;
+        if(memcmp(p, "MTrk", 4) == 0) {
+            midi->tracks[n].reader.p = data;
+            midi->tracks[n].reader.end = data + size;
+            midi->tracks[n].division = division;
+            midi->tracks[n].smpte_us = smpte_us;
+            n++;
+        }
+        p = data + size;
+    }
+    midi->num_tracks = n;
+
+    // count how many lanes each track needs by reading it through. The
+    // first track holds the tempo map, except in format 2 files, where every
+    // track is a song of its own, so the map comes along on the same pass
+    unsigned short *scratch = malloc(MIDI_KEYS * sizeof(unsigned short) + MIDI_KEYS);
+    if(scratch == NULL) {
+        midiClose(score);
+        return -1;
+    }
+    for(t = 0; t < n; t++) {
+        struct midi_track scan = midi->tracks[t];
+        memset(scratch, 0, MIDI_KEYS * sizeof(unsigned short) + MIDI_KEYS);
+        scan.keys = scratch;
+        scan.busy = (unsigned char*)(scratch + MIDI_KEYS);
+        scan.num_lanes = MIDI_KEYS;
+        int failed = scanTrack(&scan, format == 2 || t == 0) != 0;
+        midi->tempo_maps[t] = scan.collect;
+        if(failed) {
+            free(scratch);
+            midiClose(score);
+            return -1;
+        }
+        midi->tracks[t].num_lanes = scan.max_lanes;
+        if(scan.collect != NULL) {
+            midi->tracks[t].tempo = scan.collect;
+            midi->tracks[t].num_tempo = scan.num_collect;
+        }
+        total += scan.max_lanes;
+    }
+    free(scratch);
+
+    midi->lanes = calloc(total > 0 ? total : 1, sizeof(struct midi_lane));
+    if(midi->lanes == NULL) {
+        midiClose(score);
+        return -1;
+    }
+    midi->num_lanes = total;
+
+    struct midi_lane *l = midi->lanes;
+    for(t = 0; t < n; t++) {
+        struct midi_track *track = &midi->tracks[t];
+        if(format != 2) {
+            track->tempo = midi->tracks[0].tempo;
+            track->num_tempo = midi->tracks[0].num_tempo;
+        }
+        track->keys = calloc(1, MIDI_KEYS * sizeof(unsigned short) + track->num_lanes);
+        if(track->keys == NULL) {
+            midiClose(score);
+            return -1;
+        }
+        track->busy = (unsigned char*)(track->keys + MIDI_KEYS);
+        track->lanes = l;
+        for(i = 0; i < track->num_lanes; i++, l++)
+            l->track = track;
+    }
+
+    score->num_tracks = total;
+    score->tracks = NULL;
+    return 0;
+}
+
+void midiClose(struct score *score)
+{
+    struct midi_file *midi = score->midi;
+    unsigned int t;
+
+    if(midi == NULL)
+        return;
+    for(t = 0; t < midi->num_lanes; t++)
+        free(midi->lanes[t].notes);
+    for(t = 0; t < midi->num_tracks; t++) {
+        free(midi->tracks[t].keys);
+        free(midi->tempo_maps[t]);
+    }
+    free(midi->lanes);
+    free(midi->tempo_maps);
+    free(midi->tracks);
+    free(midi);
+    score->midi = NULL;
+}
@@ -0,0 +1,112 @@
+#ifndef _MIDI_
+#define _MIDI_
+
+#include <stdint.h>
+#include "score.h"
+
+/*
+ * Standard MIDI File import for the score player. scoreOpen hands files
+ * that start with MThd to midiOpen, and each voice lane of each track then
+ * plays as a track of the score. A MIDI track's notes are spread over as
+ * many lanes as it ever has sounding together, lowest free lane first.
+ *
+ * Opening reads every track once, to count its lanes and to collect the
+ * tempo map, which all lanes then share. After that each track is read once
+ * more as it plays, by a cursor that hands every finished note to its lane.
+ * A lane holds the notes it's been handed until they're played, so memory
+ * only grows with how far one lane of a track runs ahead of another, not
+ * with the length of the file. Note-on velocities become the notes' levels.
+ */
+
+#define MIDI_KEYS (16 * 128)        // every key of every channel
+
+// a position in one MTrk chunk
+struct midi_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t tick;                  // time of the last event read
+    unsigned char status;           // for running status
+};
+
+// one event, pointing into the file
+struct midi_event {
+    unsigned char status;           // 0x80-0xEF for channel messages, 0xF0, 0xF7 or 0xFF
+    unsigned char type;             // meta event type
+    const unsigned char *data;
+    uint32_t len;
+};
+
+// a tempo change and the time it comes at. A tempo map starts with the
+// default tempo at tick 0
+struct midi_tempo {
+    uint64_t tick;
+    double us;
+    uint32_t us_per_quarter;
+};
+
+// a finished note, waiting for its lane to play it
+struct midi_note {
+    uint64_t start;                 // in ms
+    uint64_t end;
+    float hz;
+    float gain;                     // from the note-on velocity
+};
+
+struct midi_lane;
+
+// one MTrk, read through once while opening and once as it plays
+struct midi_track {
+    struct midi_reader reader;
+    unsigned int num_lanes;         // lanes of the track, or most seen when counting
+    unsigned int max_lanes;
+    unsigned char *busy;            // per lane, whether a note is sounding on it
+    unsigned short *keys;           // per key, 1 + the lane it sounds on, or 0
+    struct midi_lane *lanes;        // its first lane, NULL while counting
+    int done;
+
+    // the tempo map its times come from, and the change in effect. While
+    // counting, the track's own tempo changes are added to collect
+    const struct midi_tempo *tempo;
+    unsigned int num_tempo;
+    unsigned int tempo_at;
+    struct midi_tempo *collect;
+    unsigned int num_collect;
+    unsigned int division;          // ticks per quarter note
+    double smpte_us;                // microseconds per tick for SMPTE timing, else 0
+};
+
+struct midi_lane {
+    struct midi_track *track;
+
+    // the note sounding on this lane
+    uint64_t cur_start;             // in ms
+    float cur_hz;
+    float cur_gain;
+
+    // finished notes, oldest first, in a ring of size
+    struct midi_note *notes;
+    unsigned int head, count, size;
+    uint64_t emitted;               // ms of the lane played out so far
+};
+
+// everything midiOpen sets up for a file
+struct midi_file {
+    struct midi_track *tracks;
+    unsigned int num_tracks;
+    struct midi_lane *lanes;        // every lane of every track, in order
+    unsigned int num_lanes;
+    struct midi_tempo **tempo_maps; // per track; only the ones collected are set
+};
+
+// sets score up to play the MIDI file already mapped at score->map.
+// returns 0, or -1 if it isn't a MIDI file Synth can read
+int midiOpen(struct score *score);
+
+// produces the next event of a lane and its level. returns 0 once the lane
+// is over
+int midiNext(struct midi_lane *lane, struct score_event *e, float *gain);
+
+// frees what midiOpen set up
+void midiClose(struct score *score);
+
+#endif
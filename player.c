@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "synth.h"
+#include "score.h"
+
+int main(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+    struct score score;
+    struct synth_config config;
+    synth_t *s;
+
+    if(argc < 2) {
+        printf("usage: %s score [out.wav]\n", argv[0]);
+        return 1;
+    }
+    if(scoreOpen(&score, argv[1]) != 0)
+        return 1;
+
+    // every track gets an oscillator of its own
+    synthDefaultConfig(&config);
+    config.voices = score.num_tracks > 0 ? score.num_tracks : 1;
+    // all of them can sound at once, so leave room for every track
+    double gain = config.voices > 2 ? 2.0 / config.voices : 1.0;
+
+    // given a file name, render the score there instead of playing it
+    if(argc > 2) {
+        s = synthCreateOffline(&config);
+        if(s == NULL) {
+            scoreClose(&score);
+            return 1;
+        }
+        synthSetMasterGain(s, gain);
+        long frames = scoreRenderToFile(s, &score, argv[2]);
+        synthDestroy(s);
+        scoreClose(&score);
+        if(frames < 0)
+            return 1;
+        printf("Rendered %ld frames to %s\n", frames, argv[2]);
+        return 0;
+    }
+
+    s = synthCreate(&config);
+    if(s == NULL) {
+        scoreClose(&score);
+        return 1;
+    }
+    synthSetMasterGain(s, gain);
+    scorePlay(s, &score);
+    synthDestroy(s);
+    scoreClose(&score);
+    return 0;
+}
@@ -0,0 +1,282 @@
+#ifdef SYNTH_RT_CHECK
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "rtcheck.h"
+
+// how deep the calling thread is in rtEnter sections
+__thread int rt_depth = 0;
+
+// glibc's own allocator, under the names it exports for wrappers like these
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+
+// the real versions of everything else, looked up before main runs
+int (*real_mutex_lock)(pthread_mutex_t *m);
+int (*real_mutex_trylock)(pthread_mutex_t *m);
+int (*real_once)(pthread_once_t *once, void (*init)(void));
+int (*real_cond_wait)(pthread_cond_t *c, pthread_mutex_t *m);
+int (*real_cond_timedwait)(pthread_cond_t *c, pthread_mutex_t *m,
+                           const struct timespec *abstime);
+int (*real_cond_signal)(pthread_cond_t *c);
+int (*real_cond_broadcast)(pthread_cond_t *c);
+int (*real_sem_wait)(sem_t *sem);
+int (*real_sem_timedwait)(sem_t *sem, const struct timespec *abstime);
+int (*real_sem_post)(sem_t *sem);
+int (*real_nanosleep)(const struct timespec *req, struct timespec *rem);
+int (*real_usleep)(useconds_t usec);
+ssize_t (*real_read)(int fd, void *buf, size_t count);
+ssize_t (*real_write)(int fd, const void *buf, size_t count);
+int (*real_poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+
+// finds the real functions. Run before main, and again from any wrapper
+// called before that
+void rtResolve(void) __attribute__((constructor));
+
+// reports a call made in a real-time section and aborts, so a debugger or
+// core dump shows where it came from
+void rtViolation(const char *call);
+
+void rtEnter(void)
+{
+    rt_depth++;
+}
+
+void rtLeave(void)
+{
+    rt_depth--;
+}
+
+void rtViolation(const char *call)
+{
+    const char *msg = "synth: called on the audio thread: ";
+
+    // nothing that could allocate or lock, to say so
+    rt_depth = 0;
+    if(real_write == NULL)
+        rtResolve();
+    real_write(2, msg, strlen(msg));
+    real_write(2, call, strlen(call));
+    real_write(2, "\n", 1);
+    abort();
+}
+
+void rtResolve(void)
+{
+    real_mutex_lock = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+    real_mutex_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+    real_once = dlsym(RTLD_NEXT, "pthread_once");
+    real_cond_wait = dlsym(RTLD_NEXT, "pthread_cond_wait");
+    real_cond_timedwait = dlsym(RTLD_NEXT, "pthread_cond_timedwait");
+    real_cond_signal = dlsym(RTLD_NEXT, "pthread_cond_signal");
+    real_cond_broadcast = dlsym(RTLD_NEXT, "pthread_cond_broadcast");
+    real_sem_wait = dlsym(RTLD_NEXT, "sem_wait");
+    real_sem_timedwait = dlsym(RTLD_NEXT, "sem_timedwait");
+    real_sem_post = dlsym(RTLD_NEXT, "sem_post");
+    real_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+    real_usleep = dlsym(RTLD_NEXT, "usleep");
+    real_read = dlsym(RTLD_NEXT, "read");
+    real_write = dlsym(RTLD_NEXT, "write");
+    real_poll = dlsym(RTLD_NEXT, "poll");
+}
+
+void *malloc(size_t size)
+{
+    if(rt_depth)
+        rtViolation("malloc");
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if(rt_depth)
+        rtViolation("calloc");
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    if(rt_depth)
+        rtViolation("realloc");
+    return __libc_realloc(p, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if(rt_depth)
+        rtViolation("aligned_alloc");
+    return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    if(rt_depth)
+        rtViolation("memalign");
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size)
+{
+    if(rt_depth)
+        rtViolation("posix_memalign");
+    *p = __libc_memalign(alignment, size);
+    return *p != NULL ? 0 : ENOMEM;
+}
+
+void free(void *p)
+{
+    if(rt_depth)
+        rtViolation("free");
+    __libc_free(p);
+}
+
+int pthread_mutex_lock(pthread_mutex_t *m)
+{
+    if(rt_depth)
+        rtViolation("pthread_mutex_lock");
+    if(real_mutex_lock == NULL)
+        rtResolve();
+    return real_mutex_lock(m);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *m)
+{
+    if(rt_depth)
+        rtViolation("pthread_mutex_trylock");
+    if(real_mutex_trylock == NULL)
+        rtResolve();
+    return real_mutex_trylock(m);
+}
+
+// waits for whoever runs init first, so it counts as a lock
+int pthread_once(pthread_once_t *once, void (*init)(void))
+{
+    if(rt_depth)
+        rtViolation("pthread_once");
+    if(real_once == NULL)
+        rtResolve();
+    return real_once(once, init);
+}
+
+int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+    if(rt_depth)
+        rtViolation("pthread_cond_wait");
+    if(real_cond_wait == NULL)
+        rtResolve();
+    return real_cond_wait(c, m);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+                           const struct timespec *abstime)
+{
+    if(rt_depth)
+        rtViolation("pthread_cond_timedwait");
+    if(real_cond_timedwait == NULL)
+        rtResolve();
+    return real_cond_timedwait(c, m, abstime);
+}
+
+int pthread_cond_signal(pthread_cond_t *c)
+{
+    if(rt_depth)
+        rtViolation("pthread_cond_signal");
+    if(real_cond_signal == NULL)
+        rtResolve();
+    return real_cond_signal(c);
+}
+
+int pthread_cond_broadcast(pthread_cond_t *c)
+{
+    if(rt_depth)
+        rtViolation("pthread_cond_broadcast");
+    if(real_cond_broadcast == NULL)
+        rtResolve();
+    return real_cond_broadcast(c);
+}
+
+int sem_wait(sem_t *sem)
+{
+    if(rt_depth)
+        rtViolation("sem_wait");
+    if(real_sem_wait == NULL)
+        rtResolve();
+    return real_sem_wait(sem);
+}
+
+int sem_timedwait(sem_t *sem, const struct timespec *abstime)
+{
+    if(rt_depth)
+        rtViolation("sem_timedwait");
+    if(real_sem_timedwait == NULL)
+        rtResolve();
+    return real_sem_timedwait(sem, abstime);
+}
+
+int sem_post(sem_t *sem)
+{
+    if(rt_depth)
+        rtViolation("sem_post");
+    if(real_sem_post == NULL)
+        rtResolve();
+    return real_sem_post(sem);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    if(rt_depth)
+        rtViolation("nanosleep");
+    if(real_nanosleep == NULL)
+        rtResolve();
+    return real_nanosleep(req, rem);
+}
+
+int usleep(useconds_t usec)
+{
+    if(rt_depth)
+        rtViolation("usleep");
+    if(real_usleep == NULL)
+        rtResolve();
+    return real_usleep(usec);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    if(rt_depth)
+        rtViolation("read");
+    if(real_read == NULL)
+        rtResolve();
+    return real_read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    if(rt_depth)
+        rtViolation("write");
+    if(real_write == NULL)
+        rtResolve();
+    return real_write(fd, buf, count);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    if(rt_depth)
+        rtViolation("poll");
+    if(real_poll == NULL)
+        rtResolve();
+    return real_poll(fds, nfds, timeout);
+}
+
+#endif
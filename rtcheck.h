@@ -0,0 +1,25 @@
+#ifndef _RTCHECK_
+#define _RTCHECK_
+
+/*
+ * Debug checks that the audio thread stays real-time safe. Code between
+ * rtEnter and rtLeave must not allocate, lock, sleep or do I/O, since any of
+ * those can keep the callback waiting on another thread or the kernel.
+ *
+ * Built with -DSYNTH_RT_CHECK, rtcheck.c replaces malloc and friends, the
+ * pthread mutex, once and condition variable calls, semaphores, sleeps, and
+ * read, write and poll with versions that abort with the name of the call if
+ * it's made inside such a section. Without it the markers compile to nothing.
+ */
+
+#ifdef SYNTH_RT_CHECK
+// marks the calling thread as running real-time code, until the matching
+// rtLeave. Sections can nest
+void rtEnter(void);
+void rtLeave(void);
+#else
+#define rtEnter()
+#define rtLeave()
+#endif
+
+#endif
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wav.h"
+#include "score.h"
+#include "midi.h"
+
+// scores are read in place, so the host has to share their byte order
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "score files are little-endian"
+#endif
+
+// notes converted per playOscBatch, and frames rendered per offline chunk
+#define SCORE_BATCH (256)
+#define SCORE_CHUNK (8192)
+
+// checks the mapped header, track table and event ranges. returns 0 if
+// the score can be played
+int scoreCheck(const struct score *score);
+
+// produces the next event of track t and the level it plays at. returns 0
+// once the track is over
+int scoreNext(struct score *score, unsigned int t, struct score_event *e,
+              float *gain);
+
+// number of notes in a track of count notes, up to its first END
+size_t trackLength(const struct note *notes, size_t count);
+
+int scoreCheck(const struct score *score)
+{
+    const struct score_header *h = (const struct score_header*) score->map;
+    unsigned int t;
+
+    if(score->size < sizeof(*h) || memcmp(h->magic, SCORE_MAGIC, 4) != 0)
+        return -1;
+    if(h->version != SCORE_VERSION)
+        return -1;
+    if(h->num_tracks > (score->size - sizeof(*h)) / sizeof(struct score_track))
+        return -1;
+
+    const struct score_track *tracks = (const struct score_track*)(h + 1);
+    for(t = 0; t < h->num_tracks; t++) {
+        if(tracks[t].offset > score->size ||
+           tracks[t].offset % sizeof(uint32_t) != 0)
+            return -1;
+        if(tracks[t].count > (score->size - tracks[t].offset) / sizeof(struct score_event))
+            return -1;
+    }
+    return 0;
+}
+
+int scoreOpen(struct score *score, const char *path)
+{
+    struct stat st;
+    unsigned int t;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("Failed to open %s\n", path);
+        return -1;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        printf("%s is not a score\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // the mapping outlives the descriptor
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        printf("Failed to map %s\n", path);
+        return -1;
+    }
+
+    score->map = map;
+    score->size = st.st_size;
+    score->midi = NULL;
+    if(st.st_size >= 4 && memcmp(map, "MThd", 4) == 0) {
+        if(midiOpen(score) != 0) {
+            printf("%s is not a MIDI file Synth can read\n", path);
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+    else {
+        if(scoreCheck(score) != 0) {
+            printf("%s is not a score\n", path);
+            munmap(map, st.st_size);
+            return -1;
+        }
+
+        // every track is read front to back, and never again
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+        const struct score_header *h = (const struct score_header*) score->map;
+        score->num_tracks = h->num_tracks;
+        score->tracks = (const struct score_track*)(h + 1);
+    }
+
+    score->cursors = calloc(score->num_tracks > 0 ? score->num_tracks : 1,
+        sizeof(struct score_cursor));
+    if(score->cursors == NULL) {
+        printf("Failed to allocate %u tracks\n", score->num_tracks);
+        if(score->midi != NULL)
+            midiClose(score);
+        munmap(map, st.st_size);
+        score->map = NULL;
+        return -1;
+    }
+    for(t = 0; t < score->num_tracks; t++) {
+        score->cursors[t].osc = -1;
+        score->cursors[t].gain = -1;
+    }
+    return 0;
+}
+
+void scoreClose(struct score *score)
+{
+    if(score->midi != NULL)
+        midiClose(score);
+    free(score->cursors);
+    munmap((void*)score->map, score->size);
+    score->cursors = NULL;
+    score->map = NULL;
+}
+
+int scoreNext(struct score *score, unsigned int t, struct score_event *e,
+              float *gain)
+{
+    if(score->midi != NULL)
+        return midiNext(&score->midi->lanes[t], e, gain);
+
+    // native scores have no levels
+    *gain = 1;
+    struct score_cursor *c = &score->cursors[t];
+    if(c->next == score->tracks[t].count)
+        return 0;
+    *e = ((const struct score_event*)(score->map + score->tracks[t].offset))[c->next++];
+    return 1;
+}
+
+int scoreFeed(synth_t *s, struct score *score)
+{
+    struct note batch[SCORE_BATCH];
+    double sample_rate = synthGetSampleRate(s);
+    unsigned int t;
+    int more = 0;
+
+    for(t = 0; t < score->num_tracks; t++) {
+        struct score_cursor *c = &score->cursors[t];
+
+        if(c->ended)
+            continue;
+        if(c->osc < 0) {
+            c->osc = synthAllocOsc(s);
+            if(c->osc < 0)
+                return 0;
+        }
+
+        for(;;) {
+            unsigned int room = synthOscQueueSpace(s, c->osc);
+            if(room > SCORE_BATCH)
+                room = SCORE_BATCH;
+
+            size_t n = 0;
+            int over = 0;
+            // a note can take two slots, with its level in front of it
+            while(n + 1 < room) {
+                struct score_event e;
+                float gain;
+                if(!scoreNext(score, t, &e, &gain)) {
+                    over = 1;
+                    break;
+                }
+
+                // the same rounding the renderer uses for the note's length
+                unsigned long frames = (e.ms / 1000.0) * sample_rate;
+
+                // a note that lasts no frames plays nothing at all
+                if(frames == 0)
+                    continue;
+                if(e.hz > 0 && gain != c->gain) {
+                    batch[n].type = VELOCITY;
+                    batch[n].ms = 0;
+                    batch[n].hz = gain;
+                    c->gain = gain;
+                    n++;
+                }
+                batch[n].type = e.hz > 0 ? NOTE : REST;
+                batch[n].ms = e.ms;
+                batch[n].hz = e.hz > 0 ? e.hz : 0;
+                c->queued_frames += frames;
+                n++;
+            }
+            if(n > 0)
+                synthPlayOscBatch(s, c->osc, batch, n);
+
+            if(over) {
+                c->ended = synthEndOsc(s, c->osc);
+                break;
+            }
+            // the queue is full
+            if(room < SCORE_BATCH)
+                break;
+        }
+
+        if(!c->ended)
+            more = 1;
+    }
+    return more;
+}
+
+void scorePlay(synth_t *s, struct score *score)
+{
+    // feeding once a buffer period keeps the queues as full as the callback
+    // keeps them busy, the same rate waitOscSpace checks at
+    double period = synthGetBufferFrames(s) / synthGetSampleRate(s);
+    struct timespec ts;
+    ts.tv_sec = (time_t)period;
+    ts.tv_nsec = (long)((period - ts.tv_sec) * 1e9);
+
+    while(scoreFeed(s, score))
+        nanosleep(&ts, NULL);
+}
+
+long scoreRenderToFile(synth_t *s, struct score *score, const char *path)
+{
+    struct wav_file wav;
+    uint64_t rendered = 0;
+    unsigned int t;
+
+    if(wavOpen(&wav, path, 2, (unsigned int)(synthGetSampleRate(s) + 0.5)) != 0)
+        return -1;
+    float *block = malloc(sizeof(float) * 2 * SCORE_CHUNK);
+    if(block == NULL) {
+        printf("Failed to allocate the render block\n");
+        wavClose(&wav);
+        return -1;
+    }
+
+    for(;;) {
+        int more = scoreFeed(s, score);
+        uint64_t n = SCORE_CHUNK;
+        uint64_t last = 0;
+
+        // only render as far as every unfinished track has notes queued, so
+        // none of them runs dry before the next feed
+        for(t = 0; t < score->num_tracks; t++) {
+            struct score_cursor *c = &score->cursors[t];
+            uint64_t ahead = c->queued_frames > rendered ?
+                c->queued_frames - rendered : 0;
+            if(!c->ended && ahead < n)
+                n = ahead;
+            if(ahead > last)
+                last = ahead;
+        }
+
+        // once everything is queued, play out to where the longest track ends
+        if(!more)
+            n = last < SCORE_CHUNK ? last : SCORE_CHUNK;
+        if(n == 0)
+            break;
+
+        synthRender(s, block, n);
+        if(wavWrite(&wav, block, n) != 0) {
+            wavClose(&wav);
+            free(block);
+            return -1;
+        }
+        rendered += n;
+    }
+
+    free(block);
+    if(wavClose(&wav) != 0)
+        return -1;
+    return rendered;
+}
+
+size_t trackLength(const struct note *notes, size_t count)
+{
+    size_t i;
+    for(i = 0; i < count; i++) {
+        if(notes[i].type == END)
+            break;
+    }
+    return i;
+}
+
+int scoreWrite(const char *path, const struct note *const *tracks,
+               const size_t *counts, unsigned int num_tracks)
+{
+    struct score_header h;
+    unsigned int t;
+    size_t i;
+    int failed = 0;
+
+    FILE *fp = fopen(path, "wb");
+    if(fp == NULL) {
+        printf("Failed to create %s\n", path);
+        return -1;
+    }
+
+    memcpy(h.magic, SCORE_MAGIC, 4);
+    h.version = SCORE_VERSION;
+    h.num_tracks = num_tracks;
+    h.reserved = 0;
+    failed |= fwrite(&h, sizeof(h), 1, fp) != 1;
+
+    // the events follow the track table, one track after another
+    uint64_t offset = sizeof(h) + sizeof(struct score_track) * num_tracks;
+    for(t = 0; t < num_tracks; t++) {
+        struct score_track track;
+        track.offset = offset;
+        track.count = trackLength(tracks[t], counts[t]);
+        failed |= fwrite(&track, sizeof(track), 1, fp) != 1;
+        offset += track.count * sizeof(struct score_event);
+    }
+
+    for(t = 0; t < num_tracks && !failed; t++) {
+        size_t len = trackLength(tracks[t], counts[t]);
+        for(i = 0; i < len; i++) {
+            struct score_event e;
+            e.ms = tracks[t][i].ms > 0 ? tracks[t][i].ms : 0;
+            e.hz = tracks[t][i].type == NOTE ? tracks[t][i].hz : 0;
+            failed |= fwrite(&e, sizeof(e), 1, fp) != 1;
+        }
+    }
+
+    if(fclose(fp) != 0 || failed) {
+        printf("Failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
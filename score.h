@@ -0,0 +1,83 @@
+#ifndef _SCORE_
+#define _SCORE_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "synth.h"
+
+/*
+ * Compact binary scores, played straight out of a memory-mapped file. A
+ * score is a header, a table with one entry per track, then every track's
+ * events back to back. Everything is little-endian and laid out so it can
+ * be read in place. Each track plays on an oscillator of its own, ends with
+ * an END once its events run out, and is fed into the note queue a batch at
+ * a time as it drains, so a score of any length plays in constant memory.
+ * Standard MIDI Files open the same way and are converted as they play, see
+ * midi.h.
+ */
+
+#define SCORE_MAGIC "SYNS"
+#define SCORE_VERSION (1)
+
+struct score_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_tracks;
+    uint32_t reserved;
+};
+
+struct score_track {
+    uint64_t offset;        // byte offset of the track's first event in the file
+    uint64_t count;         // number of events
+};
+
+struct score_event {
+    uint32_t ms;
+    float hz;               // 0 for a rest
+};
+
+// where the player is in one track
+struct score_cursor {
+    uint64_t next;          // index of the next event to queue, for native scores
+    int osc;                // oscillator the track plays on, -1 until it starts
+    int ended;              // the track's END has been queued
+    uint64_t queued_frames; // length of everything queued so far, in frames
+    float gain;             // level last queued with VELOCITY, -1 before the first
+};
+
+struct midi_file;
+
+struct score {
+    const unsigned char *map;
+    size_t size;
+    unsigned int num_tracks;
+    const struct score_track *tracks;   // NULL for MIDI files
+    struct midi_file *midi;             // MIDI files only, with a lane per track
+    struct score_cursor *cursors;
+};
+
+// maps the score or MIDI file at path and checks it. returns 0 on success
+int scoreOpen(struct score *score, const char *path);
+
+// unmaps the score
+void scoreClose(struct score *score);
+
+// queues as much of every track as fits, without blocking. Tracks claim an
+// oscillator with synthAllocOsc the first time they're fed. returns 1 while
+// some track still has events or its END left to queue
+int scoreFeed(synth_t *s, struct score *score);
+
+// feeds the score to a live synth until all of it is queued. It returns once
+// the last notes are in the queues, so destroy the synth to wait for them
+void scorePlay(synth_t *s, struct score *score);
+
+// renders the score on an offline synth into a WAV file at path, feeding
+// the queues as they drain. returns the number of frames written, or -1
+long scoreRenderToFile(synth_t *s, struct score *score, const char *path);
+
+// writes num_tracks tracks of notes as a score at path. A track stops at
+// its first END or after counts[i] notes. returns 0 on success
+int scoreWrite(const char *path, const struct note *const *tracks,
+               const size_t *counts, unsigned int num_tracks);
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "sink.h"
+
+// frames converted at a time for formats that can't be written as they are
+#define SINK_CHUNK_FRAMES (1024)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SINK_SWAP_FLOATS (1)
+#else
+#define SINK_SWAP_FLOATS (0)
+#endif
+
+// writes everything in iov to the sink's fd, however many calls it takes.
+// Sockets are sent to without SIGPIPE, so a client going away is just an
+// error. returns 0, or -1
+int writeFull(struct synth_sink *sink, struct iovec *iov, int count);
+
+// returns 1 if fd is a socket
+int isSocket(int fd);
+
+// converts n samples into dst as little-endian 16-bit or 32-bit float values.
+// returns the number of bytes written
+size_t convertSamples(unsigned char *dst, const float *src, unsigned long n,
+                      enum sink_format format);
+
+// writes frames to fd in the sink's format, with an optional prefix in front
+// of the first of them
+int writeSamples(struct synth_sink *sink, const void *prefix, size_t prefix_len,
+                 const float *samples, unsigned long frames);
+
+// the write and close of each kind of sink
+int pcmWrite(struct synth_sink *sink, const float *samples, unsigned long frames);
+int pcmClose(struct synth_sink *sink);
+int wavSinkWrite(struct synth_sink *sink, const float *samples, unsigned long frames);
+int wavSinkClose(struct synth_sink *sink);
+int streamWrite(struct synth_sink *sink, const float *samples, unsigned long frames);
+int streamClose(struct synth_sink *sink);
+
+// writes v as little-endian into p
+void sinkLE16(unsigned char *p, uint16_t v);
+void sinkLE32(unsigned char *p, uint32_t v);
+
+void sinkLE16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+void sinkLE32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+int isSocket(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+int writeFull(struct synth_sink *sink, struct iovec *iov, int count)
+{
+    while(count > 0) {
+        ssize_t n;
+        if(sink->socket) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            n = sendmsg(sink->fd, &msg, MSG_NOSIGNAL);
+        } else
+            n = writev(sink->fd, iov, count);
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // skip whatever was written, which can end part way into an entry
+        while(count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+size_t convertSamples(unsigned char *dst, const float *src, unsigned long n,
+                      enum sink_format format)
+{
+    unsigned long i;
+
+    if(format == SINK_S16) {
+        for(i = 0; i < n; i++) {
+            float x = src[i];
+            if(x > 1)
+                x = 1;
+            else if(x < -1)
+                x = -1;
+            sinkLE16(dst + 2 * i, (uint16_t)(int16_t)(x * 32767.0f));
+        }
+        return 2 * n;
+    }
+
+    for(i = 0; i < n; i++) {
+        uint32_t v;
+        memcpy(&v, &src[i], 4);
+        sinkLE32(dst + 4 * i, v);
+    }
+    return 4 * n;
+}
+
+int writeSamples(struct synth_sink *sink, const void *prefix, size_t prefix_len,
+                 const float *samples, unsigned long frames)
+{
+    unsigned char buf[SINK_CHUNK_FRAMES * 2 * sizeof(float)];
+    struct iovec iov[2];
+
+    iov[0].iov_base = (void*)prefix;
+    iov[0].iov_len = prefix_len;
+
+    // floats in the right order go out straight from the block
+    if(sink->format == SINK_FLOAT32 && (!SINK_SWAP_FLOATS || sink->type == SINK_PCM)) {
+        iov[1].iov_base = (void*)samples;
+        iov[1].iov_len = sizeof(float) * 2 * frames;
+        return writeFull(sink, iov, 2);
+    }
+
+    while(frames > 0) {
+        unsigned long n = frames;
+        if(n > SINK_CHUNK_FRAMES)
+            n = SINK_CHUNK_FRAMES;
+        iov[1].iov_base = buf;
+        iov[1].iov_len = convertSamples(buf, samples, 2 * n, sink->format);
+        if(writeFull(sink, iov, 2) != 0)
+            return -1;
+
+        // only the first piece gets the prefix
+        iov[0].iov_len = 0;
+        samples += 2 * n;
+        frames -= n;
+    }
+    return 0;
+}
+
+int sinkOpenPcm(struct synth_sink *sink, int fd, enum sink_format format)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->type = SINK_PCM;
+    sink->format = format;
+    sink->fd = fd;
+    sink->socket = isSocket(fd);
+    sink->write = pcmWrite;
+    sink->close = pcmClose;
+    return 0;
+}
+
+int pcmWrite(struct synth_sink *sink, const float *samples, unsigned long frames)
+{
+    return writeSamples(sink, NULL, 0, samples, frames);
+}
+
+int pcmClose(struct synth_sink *sink)
+{
+    // the fd was the caller's, so it stays open
+    return 0;
+}
+
+int sinkOpenWav(struct synth_sink *sink, const char *path, unsigned int sample_rate)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->type = SINK_WAV;
+    sink->format = SINK_FLOAT32;
+    sink->fd = -1;
+    sink->write = wavSinkWrite;
+    sink->close = wavSinkClose;
+    return wavOpen(&sink->wav, path, 2, sample_rate);
+}
+
+int wavSinkWrite(struct synth_sink *sink, const float *samples, unsigned long frames)
+{
+    return wavWrite(&sink->wav, samples, frames);
+}
+
+int wavSinkClose(struct synth_sink *sink)
+{
+    return wavClose(&sink->wav);
+}
+
+int sinkOpenStream(struct synth_sink *sink, int fd, unsigned int sample_rate,
+                   enum sink_format format)
+{
+    unsigned char h[16];
+    struct iovec iov;
+
+    memset(sink, 0, sizeof(*sink));
+    sink->type = SINK_STREAM;
+    sink->format = format;
+    sink->fd = fd;
+    sink->socket = isSocket(fd);
+    sink->write = streamWrite;
+    sink->close = streamClose;
+
+    memcpy(h, SINK_STREAM_MAGIC, 4);
+    sinkLE32(h + 4, SINK_STREAM_VERSION);
+    sinkLE32(h + 8, sample_rate);
+    sinkLE16(h + 12, 2);
+    sinkLE16(h + 14, format);
+    iov.iov_base = h;
+    iov.iov_len = sizeof(h);
+    if(writeFull(sink, &iov, 1) != 0) {
+        printf("Failed to start the stream\n");
+        return -1;
+    }
+    return 0;
+}
+
+int streamWrite(struct synth_sink *sink, const float *samples, unsigned long frames)
+{
+    unsigned char h[4];
+
+    // the count goes out in the same call as the samples, so a chunk is
+    // never held back waiting on its own header
+    sinkLE32(h, frames);
+    return writeSamples(sink, h, sizeof(h), samples, frames);
+}
+
+int streamClose(struct synth_sink *sink)
+{
+    unsigned char h[4];
+    struct iovec iov;
+    int ret = 0;
+
+    sinkLE32(h, 0);
+    iov.iov_base = h;
+    iov.iov_len = sizeof(h);
+    if(writeFull(sink, &iov, 1) != 0)
+        ret = -1;
+    if(close(sink->fd) != 0)
+        ret = -1;
+    sink->fd = -1;
+    return ret;
+}
+
+int sinkConnect(struct synth_sink *sink, const char *host, const char *port,
+                unsigned int sample_rate, enum sink_format format)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, port, &hints, &res) != 0) {
+        printf("Failed to look up %s\n", host);
+        return -1;
+    }
+    for(ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0)
+            continue;
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd < 0) {
+        printf("Failed to connect to %s:%s\n", host, port);
+        return -1;
+    }
+
+    if(sinkOpenStream(sink, fd, sample_rate, format) != 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef _SINK_
+#define _SINK_
+
+#include "wav.h"
+
+/*
+ * Output sinks, for sending rendered audio somewhere other than a sound
+ * device: a raw PCM pipe, a WAV file or a chunked network stream. Sinks are
+ * handed interleaved stereo blocks on a writer thread of their own, never on
+ * the audio thread, so they are free to block on files and sockets.
+ *
+ * A network stream starts with a header of 16 bytes: "SYNT", then the
+ * version, the sample rate, and the channel count and sample format as
+ * 16-bit values. Then come chunks, each a 32-bit frame count followed by that
+ * many frames. A chunk of 0 frames ends the stream. Everything is
+ * little-endian.
+ */
+
+// score files (score.h) start with "SYNS", so a stream is never mistaken
+// for one. Version 1 streams used that magic too
+#define SINK_STREAM_MAGIC "SYNT"
+#define SINK_STREAM_VERSION (2)
+
+enum sink_format {
+    SINK_FLOAT32,   // 32-bit float
+    SINK_S16        // 16-bit signed, clipped to [-1, 1]
+};
+
+enum sink_type {
+    SINK_PCM,
+    SINK_WAV,
+    SINK_STREAM,
+    SINK_CUSTOM     // write and close filled in by the user
+};
+
+struct synth_sink {
+    // writes frames of interleaved stereo. returns 0, or -1 if the sink
+    // broke and shouldn't be written to again
+    int (*write)(struct synth_sink *sink, const float *samples, unsigned long frames);
+    // finishes and releases whatever the sink holds. returns 0 on success
+    int (*close)(struct synth_sink *sink);
+
+    enum sink_type type;
+    enum sink_format format;
+    int fd;
+    int socket;                 // fd is a socket, written with send
+    struct wav_file wav;
+    void *data;                 // for custom sinks
+};
+
+// writes raw samples to fd, which is left open. Float samples are in the
+// machine's own byte order, 16-bit ones little-endian. returns 0
+int sinkOpenPcm(struct synth_sink *sink, int fd, enum sink_format format);
+
+// writes a 32-bit float WAV file at path. returns 0, or -1 if it can't be
+// created
+int sinkOpenWav(struct synth_sink *sink, const char *path, unsigned int sample_rate);
+
+// writes a network stream to the connected socket fd, which is closed with
+// the sink. returns 0, or -1 if the header can't be sent
+int sinkOpenStream(struct synth_sink *sink, int fd, unsigned int sample_rate,
+                   enum sink_format format);
+
+// connects to host and port over TCP and opens a network stream on it.
+// returns 0, or -1 if it can't connect
+int sinkConnect(struct synth_sink *sink, const char *host, const char *port,
+                unsigned int sample_rate, enum sink_format format);
+
+#endif
@@ -1,93 +1,676 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 #include "portaudio.h"
 #include "pa_ringbuffer.h"
+#include "pa_memorybarrier.h"
+#include "kernels.h"
+#include "wav.h"
+#include "sink.h"
 #include "synth.h"
+#include "wavetable.h"
+#include "rtcheck.h"
 
-#define SAMPLE_RATE (44100)
-#define FRAMES_PER_BUFFER (210)
-#define TABLE_SIZE (210)
-#define NUM_OSCILLATORS (2)
+#define DEFAULT_SAMPLE_RATE (44100)
+#define DEFAULT_FRAMES_PER_BUFFER (210)
+#define DEFAULT_LATENCY (0.050)
+#define LOW_LATENCY_BLOCK_FRAMES (64)
+#define DEFAULT_CHANNELS (2)
+// fixed gain on every oscillator in the mix, so loudness doesn't depend on
+// the pool size. Two voices at full gain stay inside [-1, 1], like the two
+// fixed oscillators always did; past that the master gain sets the level
+#define MIX_HEADROOM (0.5)
+#define DEFAULT_ATTACK_MS (5.0)
+#define DEFAULT_RELEASE_MS (5.0)
+#define DEFAULT_NUM_OSCILLATORS (2)
+#define DEFAULT_QUEUE_SIZE (1024)
+#define SEGMENT_BUFFERS (32)
+#define CONTROL_QUEUE_SIZE (256)
+// buffers of output that can wait for the sink's writer thread
+#define SINK_BUFFERS (8)
+// the biggest callback buffer expected when the host picks the size
+#define HOST_BUFFER_FRAMES (2048)
+#define CONTROL_FRAMES (32)
+// longest a waiting producer sleeps between checks, in case the stream
+// stopped under it
+#define WAIT_FALLBACK_MS (100)
+// how many times per buffer period a waiting producer looks at the callback
+#define WAIT_SLICES (4)
+#define POOL_NONE ((unsigned int)-1)
 
-enum note_type {
-    NOTE,       // a note with a millisecond duration (ms) and frequency (hz)
-    REST,       // a note with a millisecont duration (ms) but no sound
-    WAITING,    // signifies that no note was read from the RingBuffer
-    END         // signals that this oscillator is done being used
+// an ADSR envelope. Attack and release are fit inside the note, so notes
+// keep their length; the release starts from wherever the envelope got to
+struct envelope {
+    double attack_ms;
+    double decay_ms;
+    double sustain;             // level held after the decay, 0 to 1
+    double release_ms;
 };
 
-struct frame {
-    float left;
-    float right;
+// a live parameter change, queued by setOscFreq, setOscGain and setOscWave
+// and applied at the start of the next buffer
+enum control_type {
+    CONTROL_FREQ,
+    CONTROL_GAIN,
+    CONTROL_WAVE,
+    CONTROL_RELEASE,            // releases the note queued as number value
+    CONTROL_PAN,
+    CONTROL_BUS,
+    CONTROL_BUS_GAIN,           // id is the bus
+    CONTROL_MASTER_GAIN         // id is unused
 };
 
-struct note {
-    enum note_type type;
-    int ms;
-    double hz;
-};    
+// how one oscillator's mono block goes into the stereo mix: the gain of each
+// side on the block's first frame, and how much it moves every frame after
+struct mix_ramp {
+    float left, right;
+    float step_left, step_right;
+};
+
+struct control {
+    enum control_type type;
+    unsigned int id;
+    double value;
+};
 
 struct osc {
 
     void *rbuf_ptr;
     PaUtilRingBuffer rbuf;
-   
-    float *table;
-    double vol;
-    double left_phase;
-    double right_phase; 
-
-    int frames_played;          // this will be -1 if no curr_note is available
-    unsigned long int num_frames;         
-    struct note curr_note;
 
-    sem_t finished;
+    // producer side bookkeeping, only touched by the thread queuing notes
+    int claimed;                // handed out by allocOsc or written to by id
+    int ended;                  // the last note queued was an END
+    unsigned long stamp;        // when it was claimed, used to pick a voice to steal
+    unsigned long written;      // number of notes queued so far
+    unsigned long note_seq;     // value of written for the last noteOn's note
+    unsigned int prev, next;    // place in the pool's allocation order
+    int pooled;                 // in the free part of that order
+
+    // shared between the producer and the callback
+    volatile int listed;                  // on (or on its way to) the active list
+    volatile unsigned long consumed;      // number of notes the callback has taken
+    volatile unsigned long discard_until; // notes up to this count belong to
+                                          // an owner before the current one
+
+    const struct wave *wave;
+
+    struct envelope env;        // set by setOscEnvelope, read when a note starts
+    unsigned long env_attack;   // frame of the current note the attack ends on
+    unsigned long env_decay;    // frame the decay ends on
+    unsigned long env_release;  // frame the release starts on
+    float env_sustain;
+    float env_released;         // level the release starts from
+    uint32_t noise[NOISE_LANES];    // xorshift states for noise, never 0
+    float pink[3];                  // pink noise filter state
+    uint32_t inc_target;        // phase step a frequency change glides to
+    unsigned int glide_left;    // CONTROL_FRAMES steps left to get there
+    float gain_target;          // gain the next buffer ramps to
+    float velocity;             // level of the notes, set by VELOCITY notes.
+                                // Each new owner starts at 1
+    float pan_left, pan_right;  // the pan position's share of each side
+    unsigned int bus;
+    int mix_snap;               // jump to the mix gains instead of ramping to them
+
+    int playing;                // curr_note is being played
+    unsigned long frames_played;    // how far into it, never past num_frames
+    unsigned long int num_frames;
+    struct note curr_note;
+    unsigned long curr_seq;     // value of consumed when curr_note was taken
+    unsigned long release_seq;  // note to cut short with a release, by curr_seq
 };
 
 /* Globals */
-float noise[TABLE_SIZE];
-float sine[TABLE_SIZE];
-float saw[TABLE_SIZE];
+// everything one synth instance owns. It lives at the start of a single
+// allocation, followed by the oscillators, their note queues and the
+// scratch blocks
+struct synth {
+    PaStream *stream;
+    struct osc *oscillators;
+    unsigned int num_oscillators;
+    int offline;                    // no callback is running, rendering is manual
+
+    // the device openStream plays on, from the config
+    int device;
+    double latency;
+
+    // with idle_frames set, the callback stops the stream once nothing has
+    // played for that many frames. idle is set while the stream isn't
+    // running, and whoever queues something next takes it back and starts
+    // the stream again
+    unsigned long idle_frames;
+    unsigned long quiet_frames;     // frames since something last played
+    volatile int idle;
+
+    // with lazy_start, stream is NULL until whoever queues something first
+    // opens and starts it under open_lock, before queuing anything, and
+    // clears lazy_open
+    int lazy;
+    volatile int lazy_open;
+    pthread_mutex_t open_lock;
+
+    // stream format, picked by initSynthEx. Everything renders in stereo blocks
+    // of frames_per_buffer; the callback splits whatever buffer it's given
+    // into them and spreads them over out_channels. stream_frames is what
+    // the stream was opened with, which is bigger with block_frames set
+    double sample_rate;
+    unsigned long frames_per_buffer;
+    unsigned long stream_frames;
+    int out_channels;
+
+    // size of every oscillator's note queue, always a power of two
+    unsigned int queue_size;
+
+    // callback statistics. Only the callback writes them. stats_seq is odd
+    // while it's in the middle of an update, so readers can retry torn copies
+    struct synth_stats stats;
+    volatile unsigned long stats_seq;
+    volatile int stats_reset;       // set by readers, handled by the callback
+    unsigned int block_active;      // most oscillators active in the last renderBlock
+    unsigned int block_audible;     // blocks mixed into the last renderBlock
+    unsigned long alloc_clock;
+
+    // storage for every oscillator's note queue
+    struct note *notes_ptr;
+
+    // the state the kernels read and write every block, one entry per
+    // oscillator id. It's kept out of struct osc so rendering voice after
+    // voice walks a few packed arrays instead of striding over the queues
+    uint32_t *phase;            // position in the table, as a fraction of 2^32
+    uint32_t *phase_inc;        // phase step per frame for the current note
+    float *mix_left;            // gain into each side of the mix on the
+    float *mix_right;           // last frame of the last buffer
+    const float **table;        // mip level of the wave picked for the current note
+
+    // ids of the oscillators the callback walks. Only the callback touches
+    // these; producers hand it newly listed oscillators through activate_rbuf
+    unsigned int *active;
+    unsigned int num_active;
+    unsigned int *activate_ptr;
+    PaUtilRingBuffer activate_rbuf;
+
+    // every oscillator, in the order allocOsc hands them out. Those known to
+    // be free come first, then the claimed ones, least recently claimed
+    // first, so the head is always the one to take. Only producers touch it;
+    // the callback hands back the oscillators it retires through freed_rbuf
+    unsigned int pool_head, pool_tail;
+    unsigned int *freed_ptr;
+    PaUtilRingBuffer freed_rbuf;
+
+    // parameter changes from the (single) controlling thread to the callback
+    struct control *control_ptr;
+    PaUtilRingBuffer control_rbuf;
+
+    // gains the mix applies on top of each oscillator's, set by controls.
+    // mix_scale is the fixed headroom, MIX_HEADROOM
+    float bus_gain[SYNTH_BUSES];
+    float master_gain;
+    float mix_scale;
+
+    // scratch block each oscillator is rendered into before being mixed down
+    float *osc_block;
+
+    // stereo mix for streams that aren't stereo, before it's spread over channels
+    float *channel_block;
+
+    // offline rendering always runs whole buffers, like the callback does.
+    // offline_pending frames at the end of offline_block are still to be handed out
+    float *offline_block;
+    unsigned long offline_pending;
+
+    // buffers rendered in real time so far. Bumping it is all the callback
+    // does for producers waiting on it; they watch it from their own thread
+    volatile unsigned long buffers_done;
+
+    // number of threads the offline renderer splits oscillators across, and
+    // the workers doing it, started by the first threaded render and kept
+    // until the instance goes or the thread count changes
+    unsigned int render_threads;
+    struct render_segment *render_pool;
+
+    // the output sink and the frames on their way to it. Whatever renders
+    // (the callback, or sink_render on an instance without a device) puts
+    // them in sink_rbuf, and sink_writer hands them to the sink from there.
+    // The callback copies what it played in; sink_render renders in place
+    struct synth_sink *sink;
+    float *sink_ptr;
+    PaUtilRingBuffer sink_rbuf;
+    pthread_t sink_render, sink_writer;
+    int sink_rendering;             // sink_render runs in place of a stream
+    volatile int sink_stop_render, sink_stop_write;
+    int block_dropped;              // the last buffer didn't fit in sink_rbuf
+};
+
+// the instance behind the original single-synth functions. It points at an
+// empty instance when nothing is running, so they fail the same way as before
+struct synth idle_synth;
+synth_t *default_synth = &idle_synth;
+
+// queue size and thread count for instances whose config doesn't pick them
+unsigned int default_queue_size = DEFAULT_QUEUE_SIZE;
+unsigned int default_threads = 1;
+
+// one segment of a threaded offline render. Every oscillator on the active
+// list is rendered over all of the segment's buffers by one worker, then the
+// buffers are mixed in the same order renderBlock would have used. The same
+// one is reused for every segment of every render
+struct render_segment {
+    synth_t *synth;
+    pthread_barrier_t barrier;
+    unsigned int num_threads;
+    int quit;
+
+    // workers 1 and up; the rendering thread is worker 0. They wait at the
+    // gate until all of them are running, or are told to quit if one can't
+    // be started, since the barrier needs every one of them
+    struct render_worker *workers;
+    pthread_mutex_t gate_lock;
+    pthread_cond_t gate;
+    int gate_open;
 
-PaStream *stream;
-struct osc oscillators[NUM_OSCILLATORS];
+    float *out;
+    unsigned int buffers;       // buffers of frames_per_buffer in this segment
+
+    unsigned int num_voices;    // oscillators on the active list at the start
+    unsigned int *voices;       // their ids, in active list order
+    unsigned int *slot;         // index into voices, by oscillator id
+    int *retire;                // buffer the oscillator leaves the list on, or -1
+    int *last_end;              // last buffer the oscillator played an END on, or -1
+
+    // per oscillator and buffer: the rendered samples, if it wasn't silent,
+    // and how they go into the mix
+    float *samples;
+    char *rendered;
+    struct mix_ramp *mix;
+
+    // the active list as renderBlock would see it, for every buffer
+    unsigned int *order;
+    unsigned int *order_count;
+};
+
+struct render_worker {
+    struct render_segment *seg;
+    unsigned int thread;
+    pthread_t handle;
+};
 
 /* Function declarations */
 // print an error and abort
 void error(PaError err);
 
-// callback used by PulseAudio to generate sound
+// print an error and carry on
+void reportError(PaError err);
+
+// callback used by PulseAudio to generate sound. userData is the synth
 int paCallback(const void *inputBuffer, void *outputBuffer,
                 unsigned long framesPerBuffer,
                 const PaStreamCallbackTimeInfo *timeInfo,
                 PaStreamCallbackFlags statusFlags,
                 void *userData);
 
-struct frame getNextFrame(struct osc *osc);
- 
-// registers a note on the given oscillator at hz frequency for ms milliseconds
-void playOsc(unsigned int id, unsigned int ms, double hz);
+// returns 1 if the callback has nothing to play and no controls to apply
+int callbackIdle(synth_t *s);
+
+// renders one buffer of every active oscillator into buffer. this is the
+// whole pipeline, shared by paCallback and the offline renderer
+void renderBlock(synth_t *s, float *buffer, unsigned long frames);
+
+// records one callback's render time and flags in stats
+void updateStats(synth_t *s, double seconds, unsigned long frames,
+                 const PaStreamCallbackTimeInfo *timeInfo,
+                 PaStreamCallbackFlags statusFlags);
+
+// copies the callback statistics into out, consistently
+void synthGetStats(synth_t *s, struct synth_stats *out);
+
+// returns the output latency PortAudio reports for the stream, in seconds,
+// or 0 if there is no stream
+double synthGetLatency(synth_t *s);
+
+// zeroes the callback statistics the next time the callback runs
+void synthResetStats(synth_t *s);
+
+// returns how many notes are waiting in the oscillator's queue
+unsigned int synthOscQueueFill(synth_t *s, unsigned int id);
+
+// return the sample rate and block size the synth renders at
+double synthGetSampleRate(synth_t *s);
+unsigned long synthGetBufferFrames(synth_t *s);
+
+// returns the current time in seconds, for timing callbacks
+double monotonicTime(void);
+
+// renders frames of the oscillator into the mono block, moving on to the
+// next queued note the frame the current one ends. ended is set if the
+// oscillator played an END and has nothing queued after it. mix is set to
+// how the block goes into the stereo mix. returns 0 if block is silent, in
+// which case nothing was written to it
+int renderOscBlock(synth_t *s, unsigned int id, float *block,
+                   unsigned long frames, int *ended, struct mix_ramp *mix);
+
+// works out the oscillator's gains into each side of the mix from its gain
+// and pan, its bus and the master gain, and ramps to them over frames
+void mixGains(synth_t *s, unsigned int id, unsigned long frames,
+              struct mix_ramp *mix);
+
+// renders the next n frames of the current note, with its volume ramps
+void renderNote(synth_t *s, unsigned int id, float *dst, unsigned long n);
+
+// takes the next note off the oscillator's queue, skipping stolen ones, and
+// puts the velocity back to 1 on the first note of a new owner. curr_note
+// is WAITING if the queue was empty
+void nextNote(struct osc *osc);
+
+// drops the oscillator at index i of the active list, unless something was
+// queued on it meanwhile. returns 1 if it was dropped
+int retireOsc(synth_t *s, unsigned int i);
+
+// queues n on the oscillator, listing it with the callback if needed.
+// returns 1 if it was queued, 0 if the queue was full
+int queueNote(synth_t *s, unsigned int id, struct note *n);
+
+// marks the oscillator as claimed by whoever is queuing notes on it
+void claimOsc(synth_t *s, struct osc *osc);
+
+// lists the oscillator with the callback, if it isn't already
+void listOsc(synth_t *s, unsigned int id);
+
+// returns 1 if the oscillator can be handed out by allocOsc
+int oscIsFree(struct osc *osc);
+
+// returns 1 if the oscillator was used and has played everything up to its END
+int oscFinished(struct osc *osc);
+
+// returns 1 once every oscillator that was used has played its END
+int synthIsFinished(synth_t *s);
+
+// returns 1 if the oscillator has nothing left to play: it was never used,
+// or it played everything up to its END
+int synthOscDone(synth_t *s, unsigned int id);
+
+// sleeps for one buffer period
+void sleepBuffer(synth_t *s);
+
+// sleeps until the callback has rendered another buffer, or timeout_ms is
+// up, looking WAIT_SLICES times per buffer period
+void waitCallback(synth_t *s, int timeout_ms);
+
+// counts a buffer as rendered, for the threads in waitCallback. Called by
+// whatever renders in real time, after each buffer. Never blocks, and
+// doesn't touch another thread
+void wakeWaiters(synth_t *s);
+
+// claims an oscillator from the pool, stealing the oldest one if all are in use
+int synthAllocOsc(synth_t *s);
+
+// the oscillator synthAllocOsc would claim next, without claiming it
+unsigned int pickOsc(synth_t *s);
 
-// registers a rest(no sound) on the given oscillator for ms milliseconds
-void restOsc(unsigned int id, unsigned int ms);
+// takes the oscillator pickOsc returned, stealing it if it's in use
+void takeOsc(synth_t *s, unsigned int id);
 
-// signals that this oscillator is done being used.
-void endOsc(unsigned int id);
+// take the oscillator out of the pool order, and put it back at the front
+// (free) or the back (just claimed)
+void poolUnlink(synth_t *s, unsigned int id);
+void poolPushFront(synth_t *s, unsigned int id);
+void poolPushBack(synth_t *s, unsigned int id);
 
-// initializes Synth
-void initSynth(void);
+// moves the oscillators the callback retired to the free end of the pool
+void collectFreed(synth_t *s);
+
+// starts a note of hz at velocity on a voice from the pool, for ms
+// milliseconds or until synthNoteOff if ms is 0. It steals the oldest voice
+// when none are free, not the quietest: finding that needs a scan of the
+// pool. returns a handle for synthNoteOff, or -1 if it couldn't be queued,
+// in which case no voice was taken
+long synthNoteOn(synth_t *s, double hz, unsigned int ms, double velocity);
+
+// releases the note, unless its voice has been stolen since. returns 1 if
+// the release was queued
+int synthNoteOff(synth_t *s, long handle);
+
+// cuts the oscillator's current note short, fading out over its release
+void releaseNote(synth_t *s, struct osc *o);
+
+// registers a note on the given oscillator at hz frequency for ms milliseconds.
+// returns 1 if it was queued, 0 if the oscillator's queue is full
+int synthPlayOsc(synth_t *s, unsigned int id, unsigned int ms, double hz);
+
+// registers a rest(no sound) on the given oscillator for ms milliseconds.
+// returns 1 if it was queued, 0 if the oscillator's queue is full
+int synthRestOsc(synth_t *s, unsigned int id, unsigned int ms);
+
+// signals that this oscillator is done being used. returns 1 if it was
+// queued, 0 if the oscillator's queue is full
+int synthEndOsc(synth_t *s, unsigned int id);
+
+// registers count notes on the given oscillator at once. returns how many
+// fit in its queue
+size_t synthPlayOscBatch(synth_t *s, unsigned int id,
+                         const struct note *notes, size_t count);
+
+// like playOscBatch, but waits for space until every note is queued.
+// returns how many were queued, which is only short of count offline
+size_t synthPlayOscBatchWait(synth_t *s, unsigned int id,
+                             const struct note *notes, size_t count);
+
+// returns how many more notes fit in the oscillator's queue
+unsigned int synthOscQueueSpace(synth_t *s, unsigned int id);
+
+// blocks until count notes fit in the oscillator's queue. returns 0 once
+// they do, or -1 if they never can: offline, or count is over the queue size
+int synthWaitOscSpace(synth_t *s, unsigned int id, unsigned int count);
+
+// sets the size of every oscillator's note queue for instances created
+// after this, rounded up to a power of two
+void setSynthQueueSize(unsigned int size);
+
+// picks the waveform the oscillator plays, even mid-note. returns 1 if the
+// change was queued, 0 if the control queue was full
+int synthSetOscWave(synth_t *s, unsigned int id, enum wave_type wave);
+
+// picks a wavetable from addWavetable, or any built-in wave by its
+// enum wave_type, for the oscillator to play. returns 1 if the change was
+// queued, 0 if the control queue was full or there's no such table
+int synthSetOscTable(synth_t *s, unsigned int id, int table);
+
+// glides the note the oscillator is playing to hz over the next buffer.
+// returns 1 if the change was queued, 0 if the control queue was full
+int synthSetOscFreq(synth_t *s, unsigned int id, double hz);
+
+// sets the oscillator's gain, ramped to over the next buffer. returns 1 if
+// the change was queued, 0 if the control queue was full
+int synthSetOscGain(synth_t *s, unsigned int id, double gain);
+
+// places the oscillator from -1 (left) to 1 (right), ramped to over the next
+// buffer. returns 1 if the change was queued, 0 if the control queue was full
+int synthSetOscPan(synth_t *s, unsigned int id, double pan);
+
+// sends the oscillator to one of the SYNTH_BUSES buses. returns 1 if the
+// change was queued, 0 if the control queue was full
+int synthSetOscBus(synth_t *s, unsigned int id, unsigned int bus);
+
+// sets the gain of a bus, or of the whole mix, ramped to over the next
+// buffer. returns 1 if the change was queued, 0 if the control queue was full
+int synthSetBusGain(synth_t *s, unsigned int bus, double gain);
+int synthSetMasterGain(synth_t *s, double gain);
+
+// the constant power pan law, scaled so the centre leaves both sides at 1
+void panGains(double pan, float *left, float *right);
+
+// queues a parameter change for the callback
+int queueControl(synth_t *s, enum control_type type, unsigned int id,
+                 double value);
+
+// the same, for changes whose id isn't an oscillator
+int pushControl(synth_t *s, enum control_type type, unsigned int id,
+                double value);
+
+// applies every queued parameter change. called at the top of each buffer
+void drainControls(synth_t *s);
+
+// kernelLookup for notes whose frequency is gliding, stepping the phase
+// increment every CONTROL_FRAMES frames of the note
+void glideLookup(synth_t *s, unsigned int id, float *dst, unsigned long n);
+
+// sets the envelope of the oscillator's notes. takes effect from the next
+// note it starts, so it's meant to be called before queuing them
+void synthSetOscEnvelope(synth_t *s, unsigned int id, double attack_ms,
+                         double decay_ms, double sustain, double release_ms);
+
+// works out where the stages of the oscillator's envelope fall in curr_note
+void startEnvelope(synth_t *s, struct osc *o);
+
+// returns the envelope level of the current note at frame t
+float envelopeLevel(struct osc *o, unsigned long t);
+
+// the same, ignoring the release
+float attackDecayLevel(struct osc *o, unsigned long t);
+
+// fills config with what initSynth uses
+void synthDefaultConfig(struct synth_config *config);
+// fills config like synthDefaultConfig, but for the lowest latency the
+// device can do: the host picks the buffer size and it's rendered in small
+// blocks, so notes and controls still take effect a block at a time
+void synthLowLatencyConfig(struct synth_config *config);
+// checks config and allocates an instance for it, with its whole pool in
+// one block of memory. returns NULL if the config can't be used
+synth_t *allocSynth(const struct synth_config *config);
+// creates a synth playing on a sound device. returns NULL if the config
+// can't be used
+synth_t *synthCreate(const struct synth_config *config);
+// returns the device the instance plays on, or -1 if there's no such
+// device. PortAudio has to be initialized
+int findDevice(synth_t *s);
+// initializes PortAudio and opens the stream on the instance's device.
+// returns 0, or -1 if it can't be opened
+int openStream(synth_t *s);
+// opens and starts the stream of a lazy_start instance the first time
+// anything is queued. Producers call it before queuing, so a device that
+// fails leaves nothing behind. returns 0 once the stream is running
+int ensureStream(synth_t *s);
+// starts the stream again if it was stopped for being idle. producers call
+// it after queuing anything, from their own thread. A stream that fails to
+// start is reported and tried again by the next call
+void wakeSynth(synth_t *s);
+// creates a synth for offline rendering. offline output is always stereo
+synth_t *synthCreateOffline(const struct synth_config *config);
+// creates a synth that renders in real time into sink instead of a sound
+// device. Output is always stereo. returns NULL if the config can't be used
+synth_t *synthCreateSink(const struct synth_config *config, struct synth_sink *sink);
+// sends everything a synth with a device plays to sink as well. returns 0,
+// or -1 if it can't take one
+int synthAttachSink(synth_t *s, struct synth_sink *sink);
+// sets up the sink's queue and writer thread, and the render thread too if
+// render is set. returns 0, or -1 if they can't be started
+int startSink(synth_t *s, struct synth_sink *sink, int render);
+// copies a rendered stereo buffer into the sink's queue, or drops it and sets
+// block_dropped if there is no room. Never blocks, so the callback can call it
+void pushSink(synth_t *s, const float *stereo, unsigned long frames);
+// renders a buffer at a time into the sink's queue, keeping to the sample rate
+void *sinkRender(void *arg);
+// hands queued frames to the sink until stopped, then whatever is left.
+// Nothing wakes it, so it looks at the queue once per buffer period
+void *sinkWriter(void *arg);
+// stops the sink's threads once everything queued is written, and closes it
+void stopSink(synth_t *s);
+// waits for every used oscillator to end, then destroys the synth
+void synthDestroy(synth_t *s);
+// the same, but waits at most timeout_ms. returns 0, or -1 if some
+// oscillators were still playing and got cut off
+int synthDestroyTimeout(synth_t *s, unsigned int timeout_ms);
+// destroys the synth right away, dropping whatever is still queued
+void synthDestroyForce(synth_t *s);
+// stops the stream, immediately if abort is set, and frees the instance
+void closeSynth(synth_t *s, int abort);
+// copies a stereo block into a stream of out_channels channels
+void spreadChannels(synth_t *s, float *out, const float *stereo,
+                    unsigned long frames);
+
+// initializes Synth. returns 0, or -1 if the device can't be opened
+int initSynth(void);
+// initializes Synth with a pool of num_voices oscillators. returns 0, or -1
+// if the device can't be opened or the pool can't be allocated
+int initSynthVoices(unsigned int num_voices);
+// initializes Synth with the given stream format, device and pool.
+// returns 0, or -1 if the config can't be used
+int initSynthEx(const struct synth_config *config);
 // terminates Synth
 void termSynth(void);
+// terminates Synth once every used oscillator has ended, or after timeout_ms
+// at the latest. returns 0, or -1 if some were still playing and got cut off
+int termSynthTimeout(unsigned int timeout_ms);
+// terminates Synth right away, dropping whatever is still queued
+void termSynthForce(void);
+
+// initializes Synth for offline rendering, without opening a sound device.
+// returns 0, or -1 if the pool can't be allocated
+int initSynthOffline(unsigned int num_voices);
+// the same with the config's sample rate, block size, pool and queue size.
+// offline output is always stereo. returns 0, or -1 for a bad config
+int initSynthOfflineEx(const struct synth_config *config);
+// terminates an offline Synth
+void termSynthOffline(void);
+
+// renders the next frames of stereo output into out
+void synthRender(synth_t *s, float *out, size_t frames);
+
+// sets how many threads offline rendering splits the oscillators across
+void synthSetThreads(synth_t *s, unsigned int num_threads);
 
-// helper function for initSynth. Initializes the wavetables: noise, sine, and saw 
-void initTables(void);
+// renders up to frames of output through offline_block. if stop is set it
+// stops after the buffer in which the synth finished. returns frames rendered
+size_t renderOffline(synth_t *s, float *out, size_t frames, int stop);
 
-// helper function for initSynth. Initializes the oscillators array
-void initOscillators(void);
+// renders whole buffers straight into out on the workers of render_pool,
+// which startRenderPool has to have started. returns the number of buffers rendered, which is less than buffers only
+// if stop is set and the synth finished
+unsigned int renderThreaded(synth_t *s, float *out, unsigned int buffers,
+                            int stop);
+
+// render and mix the share of a segment belonging to one thread
+void renderSegmentOscs(struct render_segment *seg, unsigned int thread);
+void mixSegment(struct render_segment *seg, unsigned int thread);
+
+// entry point of the render worker threads
+void *renderWorker(void *arg);
+
+// starts s->render_threads - 1 workers and allocates what they share, unless
+// they're running already. returns 0, or -1 if they can't be started
+int startRenderPool(synth_t *s);
+
+// stops the workers and frees the pool, if there is one
+void stopRenderPool(synth_t *s);
+
+// frees the pool's arrays
+void freeRenderPool(struct render_segment *seg);
+
+// renders into a WAV file at path until every used oscillator has ended, or
+// max_frames were written if that isn't 0. returns the number of frames
+// written, or -1 on error
+long synthRenderToFile(synth_t *s, const char *path, size_t max_frames);
+
+// returns the table of w with the most harmonics that all stay below
+// nyquist at hz
+const float *mipTable(synth_t *s, const struct wave *w, double hz);
+
+// returns how far the phase moves per frame at hz, wrapped to one period
+uint32_t phaseIncrement(synth_t *s, double hz);
+
+// sets up the oscillator pool and queues of a freshly allocated instance
+void initOscillators(synth_t *s);
+
+// rounds n up to a power of two, as the ring buffers need
+unsigned int nextPowerOfTwo(unsigned int n);
+
+// rounds n up to a whole number of cache lines
+size_t cacheAlign(size_t n);
 
 /* Function definitions */
 
@@ -97,267 +680,2239 @@ void error(PaError err)
     exit(-1);
 }
 
+void reportError(PaError err)
+{
+    printf("Error message: %s\n", Pa_GetErrorText(err));
+}
+
 
 int paCallback(const void *inputBuffer, void *outputBuffer,
                 unsigned long framesPerBuffer,
                 const PaStreamCallbackTimeInfo *timeInfo,
                 PaStreamCallbackFlags statusFlags,
                 void *userData) {
-    int i; 
-    struct osc *osc = (struct osc*) userData;
-    float *buffer = (float*)outputBuffer;
-   
-    for(i = 0; i < NUM_OSCILLATORS; i++) { 
-        // decide what to do if we don't have a current note
-        if(osc[i].frames_played == -1) {
-            if(PaUtil_ReadRingBuffer(&osc[i].rbuf, &osc[i].curr_note, 1) == 0) {
-                // no note was read from the ring buffer 
-                osc[i].curr_note.ms = 0;
-                osc[i].curr_note.hz = 0;
-                osc[i].curr_note.type = WAITING; 
-            }
+    synth_t *s = (synth_t*) userData;
+    float *out = (float*) outputBuffer;
+    unsigned long done, n;
 
-            if(osc[i].curr_note.type == END) {
-                sem_post(&osc[i].finished);
-                osc[i].curr_note.ms = 0;
-                osc[i].curr_note.hz = 0;
-                osc[i].curr_note.type = WAITING; 
-            }
-        
-            osc[i].frames_played = 0;
-            osc[i].num_frames = (osc[i].curr_note.ms/1000.0) * SAMPLE_RATE;
-        }
-    }
- 
-    for(i = 0; i < framesPerBuffer; i++)
-    {
-        struct frame curr_frame;
-        curr_frame.left = 0;
-        curr_frame.right = 0;
-        
-        int j;
-        for(j = 0; j < NUM_OSCILLATORS; j++) {
-            // ramp up volume for first frame
-            if(osc[j].frames_played == 0)
-            {
-                osc[j].vol = (i + 1) / (float)(framesPerBuffer);
-            }
+    // nothing in here may allocate, lock, sleep, make system calls or wake
+    // other threads. clock_gettime on CLOCK_MONOTONIC is answered in user
+    // space, and waiting producers only see a counter go up
+    rtEnter();
+    double start = monotonicTime();
+    s->block_dropped = 0;
 
-            // ramp down volume for last frame
-            else if (osc[j].frames_played >= osc[j].num_frames - framesPerBuffer)
-            {
-                osc[j].vol = 1.0 - ((i + 1) / (float)(framesPerBuffer));
-            }
-            else osc[j].vol = 1;
+    // the buffer is rendered a block at a time, and each block picks up the
+    // notes and controls queued before it. Timing, statistics and the idle
+    // check are only paid once for the whole buffer
+    for(done = 0; done < framesPerBuffer; done += n) {
+        n = framesPerBuffer - done;
+        if(n > s->frames_per_buffer)
+            n = s->frames_per_buffer;
 
-            struct frame temp_frame  = getNextFrame(&osc[j]);
-            curr_frame.left += temp_frame.left/NUM_OSCILLATORS;
-            curr_frame.right += temp_frame.right/NUM_OSCILLATORS;
+        float *block = s->out_channels == 2 ? out + 2 * done : s->channel_block;
+        renderBlock(s, block, n);
+        if(s->out_channels != 2) {
+            // a silent mix spreads to silence on every channel
+            if(s->block_audible == 0)
+                memset(out + s->out_channels * done, 0, sizeof(float) * s->out_channels * n);
+            else
+                spreadChannels(s, out + s->out_channels * done, block, n);
         }
+        if(s->sink != NULL)
+            pushSink(s, block, n);
+    }
+    updateStats(s, monotonicTime() - start, framesPerBuffer, timeInfo, statusFlags);
+    wakeWaiters(s);
 
-        *buffer++ = curr_frame.left; 
-        *buffer++ = curr_frame.right;
+    if(s->idle_frames == 0 || !callbackIdle(s)) {
+        s->quiet_frames = 0;
+        rtLeave();
+        return paContinue;
+    }
+    s->quiet_frames += framesPerBuffer;
+    if(s->quiet_frames < s->idle_frames) {
+        rtLeave();
+        return paContinue;
     }
 
-    for(i = 0; i < NUM_OSCILLATORS; i++) { 
-        if(osc[i].curr_note.type != WAITING)
-            osc[i].frames_played += framesPerBuffer;
-    
-        // forget about the current note if we finished playing it
-        if(osc[i].frames_played >= osc[i].num_frames) {
-            osc[i].frames_played = -1; 
-            osc[i].num_frames = 0;
-        }
+    // the buffer just rendered still plays, then the stream stops. Whatever
+    // was queued since is either seen here, or its producer sees idle and
+    // starts the stream again; taking idle back decides which
+    s->idle = 1;
+    PaUtil_FullMemoryBarrier();
+    if(!callbackIdle(s) && __sync_bool_compare_and_swap(&s->idle, 1, 0)) {
+        s->quiet_frames = 0;
+        rtLeave();
+        return paContinue;
     }
+    rtLeave();
+    return paComplete;
+}
 
-    return paContinue; 
+int callbackIdle(synth_t *s)
+{
+    return s->num_active == 0 &&
+        PaUtil_GetRingBufferReadAvailable(&s->activate_rbuf) == 0 &&
+        PaUtil_GetRingBufferReadAvailable(&s->control_rbuf) == 0;
 }
 
-struct frame getNextFrame(struct osc *osc) {
+void spreadChannels(synth_t *s, float *out, const float *stereo,
+                    unsigned long frames)
+{
+    unsigned long i;
+    int c;
 
-    // build the return value
-    struct frame f;
-    if(osc->curr_note.type == REST || 
-       osc->curr_note.type == WAITING || 
-       osc->curr_note.type == END) {
-        f.left = 0;
-        f.right = 0;
+    // mono gets both sides, anything wider gets left and right first
+    for(i = 0; i < frames; i++) {
+        if(s->out_channels == 1)
+            *out++ = 0.5f * (stereo[2 * i] + stereo[2 * i + 1]);
+        else {
+            *out++ = stereo[2 * i];
+            *out++ = stereo[2 * i + 1];
+            for(c = 2; c < s->out_channels; c++)
+                *out++ = 0;
+        }
     }
+}
 
-    // note must be of type NOTE (or something crazy)
-    else {
-        f.left = osc->table[(int)osc->left_phase]; 
-        f.right = osc->table[(int)osc->right_phase]; 
-    
-        // update lookup table indices
-        osc->left_phase = (osc->left_phase + osc->curr_note.hz/TABLE_SIZE);
-        osc->right_phase = (osc->right_phase + osc->curr_note.hz/TABLE_SIZE);
-        if(osc->left_phase >= TABLE_SIZE)
-            osc->left_phase = osc->left_phase - TABLE_SIZE;
-        if(osc->right_phase >= TABLE_SIZE)
-            osc->right_phase = osc->right_phase - TABLE_SIZE;
+double monotonicTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void updateStats(synth_t *s, double seconds, unsigned long frames,
+                 const PaStreamCallbackTimeInfo *timeInfo,
+                 PaStreamCallbackFlags statusFlags)
+{
+    struct synth_stats *stats = &s->stats;
+    double load = seconds * s->sample_rate / frames;
+    int bucket = load / SYNTH_LOAD_BUCKET_WIDTH;
+    if(bucket >= SYNTH_LOAD_BUCKETS)
+        bucket = SYNTH_LOAD_BUCKETS - 1;
+
+    s->stats_seq++;
+    PaUtil_WriteMemoryBarrier();
+
+    if(s->stats_reset) {
+        memset(stats, 0, sizeof(*stats));
+        s->stats_reset = 0;
     }
 
-    return f;
+    stats->callbacks++;
+    stats->load_histogram[bucket]++;
+    if(load > stats->max_load)
+        stats->max_load = load;
+    if(load >= 1.0)
+        stats->overruns++;
+    if(statusFlags & paOutputUnderflow)
+        stats->underflows++;
+    if(s->block_dropped)
+        stats->sink_drops++;
+    if(s->block_active > stats->max_active)
+        stats->max_active = s->block_active;
+    if(timeInfo != NULL)
+        stats->output_latency = timeInfo->outputBufferDacTime - timeInfo->currentTime;
+
+    PaUtil_WriteMemoryBarrier();
+    s->stats_seq++;
 }
 
-void playOsc(unsigned int id, unsigned int ms, double hz) 
+void synthGetStats(synth_t *s, struct synth_stats *out)
 {
+    unsigned long seq;
+    do {
+        seq = s->stats_seq;
+        PaUtil_ReadMemoryBarrier();
+        memcpy(out, &s->stats, sizeof(s->stats));
+        PaUtil_ReadMemoryBarrier();
+    } while((seq & 1) || seq != s->stats_seq);
+}
 
-    if(id >= NUM_OSCILLATORS) {
-        printf("id %i is too large.\n", id);
-        return;
-    }
-    
-    struct note n;
-    n.type = NOTE;
-    n.ms = ms; 
-    n.hz = hz;
-    PaUtil_WriteRingBuffer(&oscillators[id].rbuf, &n, 1);
+double synthGetLatency(synth_t *s)
+{
+    // offline, or lazy and not started yet
+    if(s->offline || s->stream == NULL)
+        return 0;
+    const PaStreamInfo *info = Pa_GetStreamInfo(s->stream);
+    return info != NULL ? info->outputLatency : 0;
 }
 
-void restOsc(unsigned int id, unsigned int ms)
+void synthResetStats(synth_t *s)
 {
-    if(id >= NUM_OSCILLATORS) {
-        printf("id %i is too large.\n", id);
-        return;
-    }
-    
-    struct note n;
-    n.type = REST;
-    n.ms = ms; 
-    n.hz = 0;
-    PaUtil_WriteRingBuffer(&oscillators[id].rbuf, &n, 1);
+    s->stats_reset = 1;
 }
 
-void endOsc(unsigned int id) 
+unsigned int synthOscQueueFill(synth_t *s, unsigned int id)
 {
-    if(id >= NUM_OSCILLATORS) {
-        printf("id %i is too large.\n", id);
-        return;
+    if(id >= s->num_oscillators)
+        return 0;
+    return PaUtil_GetRingBufferReadAvailable(&s->oscillators[id].rbuf);
+}
+
+double synthGetSampleRate(synth_t *s)
+{
+    return s->sample_rate;
+}
+
+unsigned long synthGetBufferFrames(synth_t *s)
+{
+    return s->frames_per_buffer;
+}
+
+void renderBlock(synth_t *s, float *buffer, unsigned long framesPerBuffer) {
+    unsigned int i, id;
+
+    // checked offline too, so the checks cover the callback's path in tests
+    rtEnter();
+
+    // pick up the oscillators that were listed since the last callback
+    while(PaUtil_ReadRingBuffer(&s->activate_rbuf, &id, 1) == 1)
+        s->active[s->num_active++] = id;
+    s->block_active = s->num_active;
+    s->block_audible = 0;
+    drainControls(s);
+
+    // silent oscillators are skipped entirely, so with nothing audible this
+    // is all the buffer gets
+    memset(buffer, 0, sizeof(float) * 2 * framesPerBuffer);
+
+    // the scratch block only holds one buffer's worth of frames
+    while(framesPerBuffer > 0) {
+        unsigned long frames = framesPerBuffer;
+        if(frames > s->frames_per_buffer)
+            frames = s->frames_per_buffer;
+
+        for(i = 0; i < s->num_active; i++) {
+            struct mix_ramp mix;
+            int ended;
+            if(renderOscBlock(s, s->active[i], s->osc_block, frames, &ended, &mix)) {
+                kernelMix(buffer, s->osc_block, frames, mix.left, mix.right,
+                    mix.step_left, mix.step_right);
+                s->block_audible++;
+            }
+            if(ended && retireOsc(s, i))
+                i--;
+        }
+
+        buffer += 2 * frames;
+        framesPerBuffer -= frames;
     }
-    
-    struct note n;
-    n.type = END;
-    n.ms = 0; 
-    n.hz = 0;
-    PaUtil_WriteRingBuffer(&oscillators[id].rbuf, &n, 1);
+    rtLeave();
 }
 
-void initOscillators(void)
+void nextNote(struct osc *osc)
 {
-    int i;
-    for(i = 0; i < NUM_OSCILLATORS; i++) {
-        /* Initialize the struct osc for callback function */
-        oscillators[i].rbuf_ptr = malloc(sizeof(struct note) * 1024);
-        PaUtil_InitializeRingBuffer(&oscillators[i].rbuf, sizeof(struct note), 
-            1024, oscillators[i].rbuf_ptr);
-        oscillators[i].table = sine;
-        oscillators[i].left_phase = 0;
-        oscillators[i].right_phase = 0;
-        oscillators[i].frames_played = -1;
-        oscillators[i].num_frames = -1;
-        oscillators[i].vol = 0;
-       
-        sem_init(&oscillators[i].finished, 0, 0); 
-    }
-    
-    oscillators[0].table = sine;
-    oscillators[1].table = saw;
-}
-
-void initTables(void) {
-
-    /* Initialize the sine wave lookup table */
-    int i;
-    for(i = 0; i < TABLE_SIZE; i++)
-    {
-        sine[i] = (float) sin( ((double)i/(double)TABLE_SIZE) * M_PI * 2. );
+    for(;;) {
+        if(PaUtil_ReadRingBuffer(&osc->rbuf, &osc->curr_note, 1) == 0) {
+            // no note was read from the ring buffer
+            osc->curr_note.ms = 0;
+            osc->curr_note.hz = 0;
+            osc->curr_note.type = WAITING;
+            return;
+        }
+
+        osc->curr_seq = ++osc->consumed;
+        unsigned long from = osc->discard_until;
+        if(osc->curr_seq > from) {
+            if(osc->curr_seq == from + 1)
+                osc->velocity = 1;
+            return;
+        }
     }
+}
 
-    /* Initialize the saw wave lookup table */
-    for(i = 0; i < TABLE_SIZE; i++)
-    {
-        saw[i] = 1.0 - 2.0*(i/(float)TABLE_SIZE);
+int retireOsc(synth_t *s, unsigned int i)
+{
+    struct osc *osc = &s->oscillators[s->active[i]];
+
+    osc->listed = 0;
+    PaUtil_FullMemoryBarrier();
+
+    // a producer may have queued a note before it saw listed drop. whoever
+    // sets listed again first keeps the oscillator on the list
+    if(PaUtil_GetRingBufferReadAvailable(&osc->rbuf) > 0 &&
+       __sync_bool_compare_and_swap(&osc->listed, 0, 1))
+        return 0;
+
+    // tell the producers it can be handed out again. If the ring is ever
+    // full the oscillator just stays where it is in the pool until stolen
+    PaUtil_WriteRingBuffer(&s->freed_rbuf, &s->active[i], 1);
+
+    s->active[i] = s->active[--s->num_active];
+    return 1;
+}
+
+int renderOscBlock(synth_t *s, unsigned int id, float *block,
+                   unsigned long frames, int *ended, struct mix_ramp *mix) {
+    struct osc *o = &s->oscillators[id];
+    unsigned long pos = 0;
+    unsigned long filled = 0;   // block is written up to here
+    int audible = 0;
+
+    *ended = 0;
+
+    // the note being played was stolen along with the oscillator
+    if(o->playing && o->curr_seq <= o->discard_until)
+        o->playing = 0;
+
+    while(pos < frames) {
+        // decide what to do if we don't have a current note
+        if(!o->playing) {
+            nextNote(o);
+
+            if(o->curr_note.type == END) {
+                *ended = 1;
+                continue;
+            }
+
+            // nothing is queued, so stay quiet for the rest of the buffer
+            if(o->curr_note.type == WAITING)
+                break;
+
+            // applies from the next note on, on the exact frame it starts
+            if(o->curr_note.type == VELOCITY) {
+                o->velocity = o->curr_note.hz;
+                continue;
+            }
+
+            *ended = 0;
+            o->playing = 1;
+            o->frames_played = 0;
+            double length = (o->curr_note.ms/1000.0) * s->sample_rate;
+            o->num_frames = length < ULONG_MAX ? (unsigned long)length : ULONG_MAX;
+            s->table[id] = mipTable(s, o->wave, o->curr_note.hz);
+            s->phase_inc[id] = phaseIncrement(s, o->curr_note.hz);
+            o->glide_left = 0;
+            startEnvelope(s, o);
+
+            // released before it even started, so it never sounds
+            if(o->curr_seq == o->release_seq)
+                o->num_frames = 0;
+        }
+
+        // play up to the end of the note or the buffer, whichever is first
+        unsigned long n = o->num_frames - o->frames_played;
+        if(n > frames - pos)
+            n = frames - pos;
+
+        // rests only get written out if a note shares the block with them
+        if(o->curr_note.type == NOTE && n > 0) {
+            memset(block + filled, 0, sizeof(float) * (pos - filled));
+            renderNote(s, id, block + pos, n);
+            filled = pos + n;
+            audible = 1;
+        }
+
+        pos += n;
+        o->frames_played += n;
+
+        // forget about the current note if we finished playing it
+        if(o->frames_played >= o->num_frames) {
+            o->playing = 0;
+            o->num_frames = 0;
+        }
     }
-    
-    /* Initialize the noise wave lookup table */
-    for(i = 0; i < TABLE_SIZE; i++)
-    {
-        noise[i] = (float) sin( ((double)i/(double)TABLE_SIZE) * M_PI * 2. );
+
+    if(audible)
+        memset(block + filled, 0, sizeof(float) * (frames - filled));
+    mixGains(s, id, frames, mix);
+    return audible;
+}
+
+void mixGains(synth_t *s, unsigned int id, unsigned long frames,
+              struct mix_ramp *mix)
+{
+    struct osc *o = &s->oscillators[id];
+
+    // everything that scales the oscillator is folded into one gain per side
+    float gain = o->gain_target * s->bus_gain[o->bus] * s->master_gain * s->mix_scale;
+    float left = gain * o->pan_left;
+    float right = gain * o->pan_right;
+
+    if(o->mix_snap) {
+        s->mix_left[id] = left;
+        s->mix_right[id] = right;
+        o->mix_snap = 0;
     }
+
+    // a change is ramped over the whole buffer, ending on the new gains
+    mix->left = s->mix_left[id];
+    mix->right = s->mix_right[id];
+    mix->step_left = (left - mix->left) / frames;
+    mix->step_right = (right - mix->right) / frames;
+    s->mix_left[id] = left;
+    s->mix_right[id] = right;
 }
 
-void initSynth(void)
+void renderNote(synth_t *s, unsigned int id, float *dst, unsigned long n)
 {
+    struct osc *o = &s->oscillators[id];
 
-    PaStreamParameters outputParameters;
-    PaError  err;
+    if(o->wave->type == WAVE_NOISE)
+        kernelWhiteNoise(dst, o->noise, n);
+    else if(o->wave->type == WAVE_PINK)
+        kernelPinkNoise(dst, o->noise, o->pink, n);
+    else if(o->glide_left > 0)
+        glideLookup(s, id, dst, n);
+    else
+        kernelLookup(dst, s->table[id], TABLE_BITS, &s->phase[id],
+            s->phase_inc[id], n);
 
-    initTables();
-    
-    initOscillators();
+    // every stage of the envelope is linear, so it's only evaluated where a
+    // piece starts and ends, and the ramp kernel fills in between
+    unsigned long p = o->frames_played;
+    unsigned long end = p + n;
 
-    /* initialize PortAudio, and exit if theres an error */
-    err = Pa_Initialize();
-    if (err != paNoError) 
-    {
-        printf("Failed to initialize\n");
-        error(err);
-    }
+    while(p < end) {
+        unsigned long stop;
+        if(p < o->env_attack)
+            stop = o->env_attack;
+        else if(p < o->env_decay)
+            stop = o->env_decay;
+        else if(p < o->env_release)
+            stop = o->env_release;
+        else
+            stop = o->num_frames;
+        if(stop > end)
+            stop = end;
 
-    /* Define parameters for output device */
-    outputParameters.device = Pa_GetDefaultOutputDevice();
-    if (outputParameters.device == paNoDevice) {
-        printf("No default output device\n");
-        error(paNoError);
+        float gain = o->velocity * envelopeLevel(o, p);
+        float step = (o->velocity * envelopeLevel(o, stop) - gain) / (stop - p);
+
+        kernelRamp(dst, stop - p, gain, step);
+
+        dst += stop - p;
+        p = stop;
     }
-    outputParameters.channelCount = 2;
-    outputParameters.sampleFormat = paFloat32;
-    outputParameters.suggestedLatency = 0.050;
-    outputParameters.hostApiSpecificStreamInfo = NULL;
+}
 
+void glideLookup(synth_t *s, unsigned int id, float *dst, unsigned long n)
+{
+    struct osc *o = &s->oscillators[id];
+    unsigned long p = o->frames_played;
+    unsigned long end = p + n;
 
-    /* Register output-only stream callback */
-    err = Pa_OpenStream( &stream, NULL, &outputParameters, SAMPLE_RATE, 
-                        FRAMES_PER_BUFFER, paNoFlag, paCallback, &oscillators);
-    if (err != paNoError) 
-    {
-        printf("Failed to open stream\n");
-        error(err);
+    while(p < end) {
+        unsigned long stop = (p / CONTROL_FRAMES + 1) * CONTROL_FRAMES;
+        if(stop > end)
+            stop = end;
+
+        // take the next step whenever a control period starts
+        if(o->glide_left > 0 && p % CONTROL_FRAMES == 0) {
+            int64_t left = (int64_t)o->inc_target - s->phase_inc[id];
+            s->phase_inc[id] += left / (int64_t)o->glide_left;
+            o->glide_left--;
+        }
+
+        kernelLookup(dst, s->table[id], TABLE_BITS, &s->phase[id],
+            s->phase_inc[id], stop - p);
+        dst += stop - p;
+        p = stop;
     }
-    
-    /* Start the stream */
-    err = Pa_StartStream(stream);
-    if (err != paNoError) 
-    {
-        printf("StartStream failed\n");
-        error(err);
+}
+
+void startEnvelope(synth_t *s, struct osc *o)
+{
+    unsigned long len = o->num_frames;
+    double attack = o->env.attack_ms / 1000.0 * s->sample_rate;
+    double decay = o->env.decay_ms / 1000.0 * s->sample_rate;
+    double release = o->env.release_ms / 1000.0 * s->sample_rate;
+
+    // squeeze the attack and release in proportion if the note's too short
+    if(attack + release > len) {
+        double fit = len / (attack + release);
+        attack *= fit;
+        release *= fit;
     }
+
+    o->env_release = len - (unsigned long)release;
+    o->env_attack = (unsigned long)attack;
+    if(o->env_attack > o->env_release)
+        o->env_attack = o->env_release;
+    o->env_decay = o->env_attack + (unsigned long)decay;
+    if(o->env_decay > o->env_release)
+        o->env_decay = o->env_release;
+    o->env_sustain = o->env.sustain;
+
+    // the release starts from the envelope's level at that frame
+    o->env_released = attackDecayLevel(o, o->env_release);
 }
 
-void termSynth(void)
+float envelopeLevel(struct osc *o, unsigned long t)
 {
-    PaError  err;
-    
-    int i;
-    for(i = 0; i < NUM_OSCILLATORS; i++) {
-        sem_wait(&oscillators[i].finished);
-        free(oscillators[i].rbuf_ptr);
-    }
- 
-    err = Pa_StopStream(stream);
-    if (err != paNoError) 
-    {
-        printf("StopStream failed\n");
-        error(err);
+    if(t >= o->env_release) {
+        if(t >= o->num_frames)
+            return 0;
+        return o->env_released * (o->num_frames - t) /
+            (float)(o->num_frames - o->env_release);
     }
+    return attackDecayLevel(o, t);
+}
 
-    err = Pa_CloseStream(stream); 
-    if (err != paNoError) 
-    {
-        printf("Failed to close stream\n");
-        error(err);
+float attackDecayLevel(struct osc *o, unsigned long t)
+{
+    if(t < o->env_attack)
+        return t / (float)o->env_attack;
+    if(t < o->env_decay)
+        return 1 - (1 - o->env_sustain) * (t - o->env_attack) /
+            (float)(o->env_decay - o->env_attack);
+    return o->env_sustain;
+}
+
+int queueNote(synth_t *s, unsigned int id, struct note *n)
+{
+    struct osc *osc = &s->oscillators[id];
+
+    if(PaUtil_GetRingBufferWriteAvailable(&osc->rbuf) == 0)
+        return 0;
+    if(ensureStream(s) != 0)
+        return 0;
+
+    claimOsc(s, osc);
+    osc->ended = (n->type == END);
+    osc->written++;
+    PaUtil_WriteRingBuffer(&osc->rbuf, n, 1);
+    listOsc(s, id);
+    return 1;
+}
+
+void claimOsc(synth_t *s, struct osc *osc)
+{
+    // writing to an oscillator by id claims it, the same as allocOsc does
+    if(!osc->claimed || osc->pooled) {
+        unsigned int id = osc - s->oscillators;
+        poolUnlink(s, id);
+        poolPushBack(s, id);
+        osc->pooled = 0;
+        osc->claimed = 1;
+        osc->stamp = ++s->alloc_clock;
+        // everything before was played out, so this only marks where the
+        // new owner's notes start
+        osc->discard_until = osc->written;
     }
-    Pa_Terminate();
+}
+
+void listOsc(synth_t *s, unsigned int id)
+{
+    // the notes are queued before listed is checked, so either it gets listed
+    // here or the callback sees the notes before it retires the oscillator
+    if(__sync_bool_compare_and_swap(&s->oscillators[id].listed, 0, 1)) {
+        PaUtil_WriteRingBuffer(&s->activate_rbuf, &id, 1);
+        wakeSynth(s);
+    }
+}
+
+int oscIsFree(struct osc *osc)
+{
+    return !osc->claimed || (osc->ended && osc->consumed == osc->written);
+}
+
+int oscFinished(struct osc *osc)
+{
+    return osc->claimed && osc->ended && osc->consumed == osc->written;
+}
+
+int synthIsFinished(synth_t *s)
+{
+    unsigned int i;
+    for(i = 0; i < s->num_oscillators; i++) {
+        if(s->oscillators[i].claimed && !oscFinished(&s->oscillators[i]))
+            return 0;
+    }
+    return 1;
+}
+
+int synthOscDone(synth_t *s, unsigned int id)
+{
+    if(id >= s->num_oscillators)
+        return 1;
+    return !s->oscillators[id].claimed || oscFinished(&s->oscillators[id]);
+}
+
+void sleepBuffer(synth_t *s)
+{
+    double period = s->frames_per_buffer / s->sample_rate;
+    struct timespec ts;
+    ts.tv_sec = (time_t)period;
+    ts.tv_nsec = (long)((period - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+void waitCallback(synth_t *s, int timeout_ms)
+{
+    unsigned long seen = s->buffers_done;
+    double slice = s->frames_per_buffer / s->sample_rate / WAIT_SLICES;
+    double deadline = monotonicTime() + timeout_ms / 1000.0;
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)slice;
+    ts.tv_nsec = (long)((slice - ts.tv_sec) * 1e9);
+    while(s->buffers_done == seen && monotonicTime() < deadline)
+        nanosleep(&ts, NULL);
+    PaUtil_ReadMemoryBarrier();
+}
+
+void wakeWaiters(synth_t *s)
+{
+    // what the buffer drained is out before the count says so
+    PaUtil_WriteMemoryBarrier();
+    s->buffers_done++;
+}
+
+int synthAllocOsc(synth_t *s)
+{
+    if(s->num_oscillators == 0)
+        return -1;
+
+    unsigned int id = pickOsc(s);
+    takeOsc(s, id);
+    return id;
+}
+
+unsigned int pickOsc(synth_t *s)
+{
+    // the head is free if anything is, and the oldest claim otherwise
+    collectFreed(s);
+    return s->pool_head;
+}
+
+void takeOsc(synth_t *s, unsigned int id)
+{
+    struct osc *osc = &s->oscillators[id];
+
+    // the new owner's notes start after everything queued so far. If it's
+    // being stolen, the callback drops whatever of that it hasn't played
+    osc->discard_until = osc->written;
+    PaUtil_WriteMemoryBarrier();
+
+    poolUnlink(s, id);
+    poolPushBack(s, id);
+    osc->pooled = 0;
+    osc->claimed = 1;
+    osc->ended = 0;
+    osc->stamp = ++s->alloc_clock;
+}
+
+void poolUnlink(synth_t *s, unsigned int id)
+{
+    struct osc *osc = &s->oscillators[id];
+
+    if(osc->prev != POOL_NONE)
+        s->oscillators[osc->prev].next = osc->next;
+    else
+        s->pool_head = osc->next;
+    if(osc->next != POOL_NONE)
+        s->oscillators[osc->next].prev = osc->prev;
+    else
+        s->pool_tail = osc->prev;
+}
+
+void poolPushFront(synth_t *s, unsigned int id)
+{
+    struct osc *osc = &s->oscillators[id];
+
+    osc->prev = POOL_NONE;
+    osc->next = s->pool_head;
+    if(s->pool_head != POOL_NONE)
+        s->oscillators[s->pool_head].prev = id;
+    else
+        s->pool_tail = id;
+    s->pool_head = id;
+}
+
+void poolPushBack(synth_t *s, unsigned int id)
+{
+    struct osc *osc = &s->oscillators[id];
+
+    osc->next = POOL_NONE;
+    osc->prev = s->pool_tail;
+    if(s->pool_tail != POOL_NONE)
+        s->oscillators[s->pool_tail].next = id;
+    else
+        s->pool_head = id;
+    s->pool_tail = id;
+}
+
+void collectFreed(synth_t *s)
+{
+    unsigned int id;
+
+    while(PaUtil_ReadRingBuffer(&s->freed_rbuf, &id, 1) == 1) {
+        struct osc *osc = &s->oscillators[id];
+
+        // it may have been claimed again since the callback retired it
+        if(osc->pooled || !oscIsFree(osc))
+            continue;
+        poolUnlink(s, id);
+        poolPushFront(s, id);
+        osc->pooled = 1;
+    }
+}
+
+long synthNoteOn(synth_t *s, double hz, unsigned int ms, double velocity)
+{
+    struct note n[3];
+
+    if(s->num_oscillators == 0)
+        return -1;
+    unsigned int id = pickOsc(s);
+    struct osc *osc = &s->oscillators[id];
+
+    // make sure everything fits before taking the voice, so a note that
+    // can't be queued leaves it to whoever had it. A voice about to be
+    // stolen may still be full of the notes it would drop
+    if(synthOscQueueSpace(s, id) < 3 || ensureStream(s) != 0)
+        return -1;
+    takeOsc(s, id);
+
+    // the velocity goes in the queue ahead of the note, so it starts at
+    // that level on its first frame
+    n[0].type = VELOCITY;
+    n[0].ms = 0;
+    n[0].hz = velocity;
+    n[1].type = NOTE;
+    n[1].ms = ms > 0 && ms < INT_MAX ? (int)ms : INT_MAX;
+    n[1].hz = hz;
+    n[2].type = END;
+    n[2].ms = 0;
+    n[2].hz = 0;
+    synthPlayOscBatch(s, id, n, 3);
+    osc->note_seq = osc->written - 1;
+
+    // the stamp tells a handle from the ones the voice had before
+    return ((long)osc->stamp << 24) | id;
+}
+
+int synthNoteOff(synth_t *s, long handle)
+{
+    unsigned int id = handle & 0xffffff;
+
+    if(handle < 0 || id >= s->num_oscillators)
+        return 0;
+    struct osc *osc = &s->oscillators[id];
+    if(osc->stamp != (unsigned long)(handle >> 24))
+        return 0;
+    return queueControl(s, CONTROL_RELEASE, id, osc->note_seq);
+}
+
+void releaseNote(synth_t *s, struct osc *o)
+{
+    unsigned long now = o->frames_played;
+    unsigned long release = o->env.release_ms / 1000.0 * s->sample_rate;
+
+    // already on its way out
+    if(now >= o->env_release || now + release >= o->num_frames)
+        return;
+
+    // fade out from wherever the envelope got to
+    o->env_released = envelopeLevel(o, now);
+    o->env_release = now;
+    if(o->env_attack > now)
+        o->env_attack = now;
+    if(o->env_decay > now)
+        o->env_decay = now;
+    o->num_frames = now + release;
+}
+
+int synthPlayOsc(synth_t *s, unsigned int id, unsigned int ms, double hz)
+{
+
+    if(id >= s->num_oscillators) {
+        printf("id %i is too large.\n", id);
+        return 0;
+    }
+
+    struct note n;
+    n.type = NOTE;
+    n.ms = ms;
+    n.hz = hz;
+    return queueNote(s, id, &n);
+}
+
+int synthRestOsc(synth_t *s, unsigned int id, unsigned int ms)
+{
+    if(id >= s->num_oscillators) {
+        printf("id %i is too large.\n", id);
+        return 0;
+    }
+
+    struct note n;
+    n.type = REST;
+    n.ms = ms;
+    n.hz = 0;
+    return queueNote(s, id, &n);
+}
+
+int synthEndOsc(synth_t *s, unsigned int id)
+{
+    if(id >= s->num_oscillators) {
+        printf("id %i is too large.\n", id);
+        return 0;
+    }
+
+    struct note n;
+    n.type = END;
+    n.ms = 0;
+    n.hz = 0;
+    return queueNote(s, id, &n);
+}
+
+size_t synthPlayOscBatch(synth_t *s, unsigned int id,
+                         const struct note *notes, size_t count)
+{
+    void *data1, *data2;
+    ring_buffer_size_t size1, size2;
+
+    if(id >= s->num_oscillators) {
+        printf("id %i is too large.\n", id);
+        return 0;
+    }
+
+    struct osc *osc = &s->oscillators[id];
+    if(count > s->queue_size)
+        count = s->queue_size;
+
+    // copy straight into the queue, and publish the lot with one barrier
+    ring_buffer_size_t n = PaUtil_GetRingBufferWriteRegions(&osc->rbuf, count,
+        &data1, &size1, &data2, &size2);
+    if(n == 0 || ensureStream(s) != 0)
+        return 0;
+    memcpy(data1, notes, sizeof(struct note) * size1);
+    if(size2 > 0)
+        memcpy(data2, notes + size1, sizeof(struct note) * size2);
+
+    claimOsc(s, osc);
+    osc->ended = (notes[n - 1].type == END);
+    osc->written += n;
+    PaUtil_AdvanceRingBufferWriteIndex(&osc->rbuf, n);
+    listOsc(s, id);
+    return n;
+}
+
+size_t synthPlayOscBatchWait(synth_t *s, unsigned int id,
+                             const struct note *notes, size_t count)
+{
+    size_t done = 0;
+
+    if(id >= s->num_oscillators) {
+        printf("id %i is too large.\n", id);
+        return 0;
+    }
+
+    for(;;) {
+        done += synthPlayOscBatch(s, id, notes + done, count - done);
+        if(done == count)
+            return done;
+
+        // wait for half the queue rather than a single slot, so there's
+        // one wakeup per half queue of notes played instead of one per note
+        size_t wanted = count - done;
+        if(wanted > s->queue_size / 2)
+            wanted = s->queue_size / 2;
+        if(wanted == 0)
+            wanted = 1;
+        if(synthWaitOscSpace(s, id, wanted) != 0)
+            return done;
+    }
+}
+
+unsigned int synthOscQueueSpace(synth_t *s, unsigned int id)
+{
+    if(id >= s->num_oscillators)
+        return 0;
+    return PaUtil_GetRingBufferWriteAvailable(&s->oscillators[id].rbuf);
+}
+
+int synthWaitOscSpace(synth_t *s, unsigned int id, unsigned int count)
+{
+    if(id >= s->num_oscillators || count > s->queue_size)
+        return -1;
+
+    // nothing would ever drain the queue
+    struct osc *osc = &s->oscillators[id];
+    if(s->offline)
+        return PaUtil_GetRingBufferWriteAvailable(&osc->rbuf) < count ? -1 : 0;
+
+    // checked again after every buffer the callback renders
+    while(PaUtil_GetRingBufferWriteAvailable(&osc->rbuf) < count)
+        waitCallback(s, WAIT_FALLBACK_MS);
+    return 0;
+}
+
+void setSynthQueueSize(unsigned int size)
+{
+    default_queue_size = nextPowerOfTwo(size > 0 ? size : 1);
+}
+
+int synthSetOscWave(synth_t *s, unsigned int id, enum wave_type wave)
+{
+    if(wave >= WAVE_TABLE) {
+        printf("Use setOscTable for wavetables\n");
+        return 0;
+    }
+    return queueControl(s, CONTROL_WAVE, id, wave);
+}
+
+int synthSetOscTable(synth_t *s, unsigned int id, int table)
+{
+    if(wavetableGet(table) == NULL) {
+        printf("wavetable %i doesn't exist.\n", table);
+        return 0;
+    }
+    return queueControl(s, CONTROL_WAVE, id, table);
+}
+
+int synthSetOscFreq(synth_t *s, unsigned int id, double hz)
+{
+    return queueControl(s, CONTROL_FREQ, id, hz);
+}
+
+int synthSetOscGain(synth_t *s, unsigned int id, double gain)
+{
+    return queueControl(s, CONTROL_GAIN, id, gain);
+}
+
+int synthSetOscPan(synth_t *s, unsigned int id, double pan)
+{
+    if(pan < -1)
+        pan = -1;
+    if(pan > 1)
+        pan = 1;
+    return queueControl(s, CONTROL_PAN, id, pan);
+}
+
+int synthSetOscBus(synth_t *s, unsigned int id, unsigned int bus)
+{
+    if(bus >= SYNTH_BUSES) {
+        printf("bus %i is too large.\n", bus);
+        return 0;
+    }
+    return queueControl(s, CONTROL_BUS, id, bus);
+}
+
+int synthSetBusGain(synth_t *s, unsigned int bus, double gain)
+{
+    if(bus >= SYNTH_BUSES) {
+        printf("bus %i is too large.\n", bus);
+        return 0;
+    }
+    return pushControl(s, CONTROL_BUS_GAIN, bus, gain);
+}
+
+int synthSetMasterGain(synth_t *s, double gain)
+{
+    return pushControl(s, CONTROL_MASTER_GAIN, 0, gain);
+}
+
+void panGains(double pan, float *left, float *right)
+{
+    double angle = (pan + 1) * M_PI / 4;
+    *left = (float)(cos(angle) * M_SQRT2);
+    *right = (float)(sin(angle) * M_SQRT2);
+}
+
+int queueControl(synth_t *s, enum control_type type, unsigned int id,
+                 double value)
+{
+    if(id >= s->num_oscillators) {
+        printf("id %i is too large.\n", id);
+        return 0;
+    }
+    return pushControl(s, type, id, value);
+}
+
+int pushControl(synth_t *s, enum control_type type, unsigned int id,
+                double value)
+{
+    struct control c;
+    c.type = type;
+    c.id = id;
+    c.value = value;
+    if(ensureStream(s) != 0)
+        return 0;
+    if(PaUtil_WriteRingBuffer(&s->control_rbuf, &c, 1) != 1)
+        return 0;
+    wakeSynth(s);
+    return 1;
+}
+
+void drainControls(synth_t *s)
+{
+    struct control c;
+
+    while(PaUtil_ReadRingBuffer(&s->control_rbuf, &c, 1) == 1) {
+        // these two aren't about an oscillator
+        if(c.type == CONTROL_BUS_GAIN) {
+            s->bus_gain[c.id] = c.value;
+            continue;
+        }
+        if(c.type == CONTROL_MASTER_GAIN) {
+            s->master_gain = c.value;
+            continue;
+        }
+
+        struct osc *o = &s->oscillators[c.id];
+
+        switch(c.type) {
+        case CONTROL_FREQ:
+            // only a note that's playing can glide; the next one starts at its own hz
+            if(!o->playing || o->curr_note.type != NOTE)
+                break;
+            o->curr_note.hz = c.value;
+            s->table[c.id] = mipTable(s, o->wave, c.value);
+            o->inc_target = phaseIncrement(s, c.value);
+            o->glide_left = (s->frames_per_buffer + CONTROL_FRAMES - 1) / CONTROL_FRAMES;
+            break;
+
+        case CONTROL_GAIN:
+            o->gain_target = c.value;
+            break;
+
+        case CONTROL_WAVE:
+            // the handle was checked when it was queued
+            o->wave = wavetableAt((int)c.value);
+            // swap tables mid-note too. The phase carries on where it was
+            if(o->playing)
+                s->table[c.id] = mipTable(s, o->wave, o->curr_note.hz);
+            break;
+
+        case CONTROL_PAN:
+            panGains(c.value, &o->pan_left, &o->pan_right);
+            break;
+
+        case CONTROL_BUS:
+            o->bus = (unsigned int)c.value;
+            break;
+
+        case CONTROL_RELEASE:
+            // if the note hasn't started yet, it's dropped when it does
+            o->release_seq = c.value;
+            if(o->playing && o->curr_seq == o->release_seq)
+                releaseNote(s, o);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+void synthSetOscEnvelope(synth_t *s, unsigned int id, double attack_ms,
+                         double decay_ms, double sustain, double release_ms)
+{
+    if(id >= s->num_oscillators) {
+        printf("id %i is too large.\n", id);
+        return;
+    }
+
+    struct envelope *env = &s->oscillators[id].env;
+    env->attack_ms = attack_ms > 0 ? attack_ms : 0;
+    env->decay_ms = decay_ms > 0 ? decay_ms : 0;
+    env->sustain = sustain < 0 ? 0 : sustain > 1 ? 1 : sustain;
+    env->release_ms = release_ms > 0 ? release_ms : 0;
+}
+
+unsigned int nextPowerOfTwo(unsigned int n)
+{
+    unsigned int p = 1;
+    while(p < n)
+        p <<= 1;
+    return p;
+}
+
+size_t cacheAlign(size_t n)
+{
+    return (n + 63) & ~(size_t)63;
+}
+
+synth_t *allocSynth(const struct synth_config *config)
+{
+    if(config->sample_rate <= 0) {
+        printf("Invalid sample rate %f\n", config->sample_rate);
+        return NULL;
+    }
+    if(config->frames_per_buffer == 0 && config->block_frames == 0) {
+        printf("Invalid buffer size 0\n");
+        return NULL;
+    }
+    if(config->channels < 1) {
+        printf("Invalid channel count %i\n", config->channels);
+        return NULL;
+    }
+    if(config->voices == 0) {
+        printf("Invalid voice count 0\n");
+        return NULL;
+    }
+
+    unsigned int voices = config->voices;
+    unsigned int queue = config->queue_size > 0 ?
+        nextPowerOfTwo(config->queue_size) : default_queue_size;
+    // an oscillator is in the activation queue at most once at a time
+    unsigned int activate_size = nextPowerOfTwo(voices);
+    // everything renders a block at a time, so that's all the scratch holds
+    unsigned long block_frames = config->block_frames > 0 ?
+        config->block_frames : config->frames_per_buffer;
+    size_t block = sizeof(float) * 2 * block_frames;
+
+    // lay the instance out in one block: the struct, then everything it
+    // points at, each piece starting on its own cache line
+    size_t phase_at = cacheAlign(sizeof(struct synth));
+    size_t inc_at = phase_at + cacheAlign(sizeof(uint32_t) * voices);
+    size_t left_at = inc_at + cacheAlign(sizeof(uint32_t) * voices);
+    size_t right_at = left_at + cacheAlign(sizeof(float) * voices);
+    size_t table_at = right_at + cacheAlign(sizeof(float) * voices);
+    size_t osc_at = table_at + cacheAlign(sizeof(float*) * voices);
+    size_t notes_at = osc_at + cacheAlign(sizeof(struct osc) * voices);
+    size_t active_at = notes_at + cacheAlign(sizeof(struct note) * queue * voices);
+    size_t activate_at = active_at + cacheAlign(sizeof(unsigned int) * voices);
+    size_t freed_at = activate_at + cacheAlign(sizeof(unsigned int) * activate_size);
+    size_t control_at = freed_at + cacheAlign(sizeof(unsigned int) * activate_size);
+    size_t blocks_at = control_at + cacheAlign(sizeof(struct control) * CONTROL_QUEUE_SIZE);
+    size_t total = blocks_at + 3 * cacheAlign(block);
+
+    char *base = aligned_alloc(64, total);
+    if(base == NULL) {
+        printf("Failed to allocate synth\n");
+        return NULL;
+    }
+    memset(base, 0, total);
+
+    synth_t *s = (synth_t*) base;
+    s->phase = (uint32_t*)(base + phase_at);
+    s->phase_inc = (uint32_t*)(base + inc_at);
+    s->mix_left = (float*)(base + left_at);
+    s->mix_right = (float*)(base + right_at);
+    s->table = (const float**)(base + table_at);
+    s->oscillators = (struct osc*)(base + osc_at);
+    s->num_oscillators = voices;
+    s->notes_ptr = (struct note*)(base + notes_at);
+    s->active = (unsigned int*)(base + active_at);
+    s->activate_ptr = (unsigned int*)(base + activate_at);
+    s->freed_ptr = (unsigned int*)(base + freed_at);
+    s->control_ptr = (struct control*)(base + control_at);
+    s->osc_block = (float*)(base + blocks_at);
+    s->channel_block = (float*)(base + blocks_at + cacheAlign(block));
+    s->offline_block = (float*)(base + blocks_at + 2 * cacheAlign(block));
+
+    s->sample_rate = config->sample_rate;
+    s->frames_per_buffer = block_frames;
+    s->stream_frames = config->frames_per_buffer;
+    s->out_channels = config->channels;
+    s->queue_size = queue;
+    s->render_threads = default_threads;
+
+    PaUtil_InitializeRingBuffer(&s->activate_rbuf, sizeof(unsigned int),
+        activate_size, s->activate_ptr);
+    PaUtil_InitializeRingBuffer(&s->freed_rbuf, sizeof(unsigned int),
+        activate_size, s->freed_ptr);
+    PaUtil_InitializeRingBuffer(&s->control_rbuf, sizeof(struct control),
+        CONTROL_QUEUE_SIZE, s->control_ptr);
+
+    wavetableInit();
+    initOscillators(s);
+    return s;
+}
+
+void initOscillators(synth_t *s)
+{
+    unsigned int i, l;
+
+    for(i = 0; i < SYNTH_BUSES; i++)
+        s->bus_gain[i] = 1;
+    s->master_gain = 1;
+    s->mix_scale = MIX_HEADROOM;
+
+    // everything starts out free, handed out in id order
+    s->pool_head = POOL_NONE;
+    s->pool_tail = POOL_NONE;
+
+    for(i = 0; i < s->num_oscillators; i++) {
+        struct osc *o = &s->oscillators[i];
+
+        poolPushBack(s, i);
+        o->pooled = 1;
+
+        /* Initialize the struct osc for callback function */
+        o->rbuf_ptr = s->notes_ptr + (size_t)s->queue_size * i;
+        PaUtil_InitializeRingBuffer(&o->rbuf, sizeof(struct note),
+            s->queue_size, o->rbuf_ptr);
+        // even oscillators play sine waves, odd ones saw waves
+        o->wave = wavetableGet((i % 2) ? WAVE_SAW : WAVE_SINE);
+        s->table[i] = o->wave->table[0];
+        s->phase[i] = 0;
+        s->phase_inc[i] = 0;
+        o->glide_left = 0;
+        // every oscillator gets its own noise. The multiply spreads the
+        // seeds out and the or keeps them from ever being 0
+        for(l = 0; l < NOISE_LANES; l++)
+            o->noise[l] = (0x9E3779B9u * (i * NOISE_LANES + l + 1)) | 1;
+        memset(o->pink, 0, sizeof(o->pink));
+        o->gain_target = 1;
+        o->velocity = 1;
+        panGains(0, &o->pan_left, &o->pan_right);
+        o->bus = 0;
+        o->mix_snap = 1;
+        o->playing = 0;
+        o->frames_played = 0;
+        o->num_frames = 0;
+        o->env.attack_ms = DEFAULT_ATTACK_MS;
+        o->env.decay_ms = 0;
+        o->env.sustain = 1;
+        o->env.release_ms = DEFAULT_RELEASE_MS;
+    }
+}
+
+uint32_t phaseIncrement(synth_t *s, double hz)
+{
+    double cycles = hz / s->sample_rate;
+    cycles -= floor(cycles);
+    return (uint32_t)(cycles * 4294967296.0);
+}
+
+const float *mipTable(synth_t *s, const struct wave *w, double hz)
+{
+    unsigned int level = 0;
+    double nyquist = s->sample_rate / 2;
+
+    while(level + 1 < w->levels &&
+          ((TABLE_SIZE / 2 - 1) >> level) * hz >= nyquist)
+        level++;
+    return w->table[level];
+}
+
+void synthDefaultConfig(struct synth_config *config)
+{
+    config->sample_rate = DEFAULT_SAMPLE_RATE;
+    config->frames_per_buffer = DEFAULT_FRAMES_PER_BUFFER;
+    config->latency = DEFAULT_LATENCY;
+    config->device = -1;
+    config->channels = DEFAULT_CHANNELS;
+    config->voices = DEFAULT_NUM_OSCILLATORS;
+    config->queue_size = 0;
+    config->lazy_start = 0;
+    config->idle_ms = 0;
+    config->block_frames = 0;
+}
+
+void synthLowLatencyConfig(struct synth_config *config)
+{
+    synthDefaultConfig(config);
+    config->frames_per_buffer = 0;
+    config->block_frames = LOW_LATENCY_BLOCK_FRAMES;
+    config->latency = 0;
+}
+
+synth_t *synthCreate(const struct synth_config *config)
+{
+    PaError  err;
+
+    synth_t *s = allocSynth(config);
+    if(s == NULL)
+        return NULL;
+
+    s->offline = 0;
+    s->device = config->device;
+    s->latency = config->latency;
+    s->idle_frames = (unsigned long)(config->idle_ms * s->sample_rate / 1000);
+
+    // the device is left alone until there is something to play, but it
+    // has to be there
+    if(config->lazy_start) {
+        err = Pa_Initialize();
+        if (err != paNoError)
+        {
+            printf("Failed to initialize\n");
+            reportError(err);
+            free(s);
+            return NULL;
+        }
+        int device = findDevice(s);
+        Pa_Terminate();
+        if(device < 0) {
+            free(s);
+            return NULL;
+        }
+        s->lazy = 1;
+        s->lazy_open = 1;
+        s->idle = 1;
+        pthread_mutex_init(&s->open_lock, NULL);
+        return s;
+    }
+
+    if(openStream(s) != 0) {
+        free(s);
+        return NULL;
+    }
+
+    /* Start the stream */
+    err = Pa_StartStream(s->stream);
+    if (err != paNoError)
+    {
+        printf("StartStream failed\n");
+        reportError(err);
+        Pa_CloseStream(s->stream);
+        Pa_Terminate();
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+int findDevice(synth_t *s)
+{
+    int device = s->device;
+    if (device < 0)
+        device = Pa_GetDefaultOutputDevice();
+    if (device == paNoDevice) {
+        printf("No default output device\n");
+        return -1;
+    }
+    if (device >= Pa_GetDeviceCount()) {
+        printf("No output device %i\n", device);
+        return -1;
+    }
+    return device;
+}
+
+int openStream(synth_t *s)
+{
+    PaStreamParameters outputParameters;
+    PaError  err;
+
+    /* initialize PortAudio, and exit if theres an error. Every instance
+     * initializes it once and terminates it once, which PortAudio counts */
+    err = Pa_Initialize();
+    if (err != paNoError)
+    {
+        printf("Failed to initialize\n");
+        reportError(err);
+        return -1;
+    }
+
+    /* Define parameters for output device */
+    outputParameters.device = findDevice(s);
+    if (outputParameters.device < 0) {
+        Pa_Terminate();
+        return -1;
+    }
+    outputParameters.channelCount = s->out_channels;
+    outputParameters.sampleFormat = paFloat32;
+    outputParameters.suggestedLatency = s->latency;
+    if (outputParameters.suggestedLatency <= 0)
+        outputParameters.suggestedLatency =
+            Pa_GetDeviceInfo(outputParameters.device)->defaultLowOutputLatency;
+    outputParameters.hostApiSpecificStreamInfo = NULL;
+
+    /* Register output-only stream callback */
+    err = Pa_OpenStream( &s->stream, NULL, &outputParameters, s->sample_rate,
+                        s->stream_frames, paNoFlag, paCallback, s);
+    if (err != paNoError)
+    {
+        printf("Failed to open stream\n");
+        reportError(err);
+        s->stream = NULL;
+        Pa_Terminate();
+        return -1;
+    }
+    return 0;
+}
+
+int ensureStream(synth_t *s)
+{
+    PaError  err;
+
+    if(!s->lazy_open)
+        return 0;
+
+    pthread_mutex_lock(&s->open_lock);
+    if(s->lazy_open) {
+        if(openStream(s) != 0) {
+            pthread_mutex_unlock(&s->open_lock);
+            return -1;
+        }
+        // cleared first, so the callback can go idle as soon as it starts
+        s->quiet_frames = 0;
+        s->idle = 0;
+        PaUtil_FullMemoryBarrier();
+        err = Pa_StartStream(s->stream);
+        if (err != paNoError)
+        {
+            // closed again, so the next try starts over
+            printf("StartStream failed\n");
+            reportError(err);
+            Pa_CloseStream(s->stream);
+            Pa_Terminate();
+            s->stream = NULL;
+            s->idle = 1;
+            pthread_mutex_unlock(&s->open_lock);
+            return -1;
+        }
+        PaUtil_WriteMemoryBarrier();
+        s->lazy_open = 0;
+    }
+    pthread_mutex_unlock(&s->open_lock);
+    return 0;
+}
+
+void wakeSynth(synth_t *s)
+{
+    PaError  err;
+
+    // pairs with the barrier in paCallback: either it sees what was just
+    // queued, or this sees idle
+    PaUtil_FullMemoryBarrier();
+    if(s->offline || !s->idle || !__sync_bool_compare_and_swap(&s->idle, 1, 0))
+        return;
+
+    // the callback asked for it to stop, which still has to be done before
+    // it can start again. Only silence is left to play
+    err = Pa_AbortStream(s->stream);
+    if (err != paNoError)
+    {
+        printf("StopStream failed\n");
+        reportError(err);
+    }
+    s->quiet_frames = 0;
+
+    err = Pa_StartStream(s->stream);
+    if (err != paNoError)
+    {
+        // whoever queues something next tries again
+        printf("StartStream failed\n");
+        reportError(err);
+        s->idle = 1;
+    }
+}
+
+synth_t *synthCreateOffline(const struct synth_config *config)
+{
+    synth_t *s = allocSynth(config);
+    if(s == NULL)
+        return NULL;
+
+    s->offline = 1;
+    s->offline_pending = 0;
+    return s;
+}
+
+synth_t *synthCreateSink(const struct synth_config *config, struct synth_sink *sink)
+{
+    synth_t *s = allocSynth(config);
+    if(s == NULL)
+        return NULL;
+
+    s->offline = 0;
+    s->out_channels = 2;
+    if(startSink(s, sink, 1) != 0) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+int synthAttachSink(synth_t *s, struct synth_sink *sink)
+{
+    if(s == &idle_synth || s->offline) {
+        printf("Only a synth playing on a device can take a sink\n");
+        return -1;
+    }
+    if(s->sink != NULL) {
+        printf("The synth already has a sink\n");
+        return -1;
+    }
+    return startSink(s, sink, 0);
+}
+
+int startSink(synth_t *s, struct synth_sink *sink, int render)
+{
+    // room for SINK_BUFFERS of the callback's buffers, which can be bigger
+    // than the blocks rendered, and are at most HOST_BUFFER_FRAMES when the
+    // host picks their size
+    unsigned long buffer = s->frames_per_buffer;
+    if(!render && s->stream_frames > buffer)
+        buffer = s->stream_frames;
+    if(!render && s->stream_frames == 0 && buffer < HOST_BUFFER_FRAMES)
+        buffer = HOST_BUFFER_FRAMES;
+    ring_buffer_size_t frames = nextPowerOfTwo(buffer * SINK_BUFFERS);
+
+    s->sink_ptr = malloc(sizeof(float) * 2 * frames);
+    if(s->sink_ptr == NULL) {
+        printf("Failed to allocate the sink's queue\n");
+        return -1;
+    }
+    PaUtil_InitializeRingBuffer(&s->sink_rbuf, sizeof(float) * 2, frames, s->sink_ptr);
+    s->sink_stop_render = 0;
+    s->sink_stop_write = 0;
+
+    if(pthread_create(&s->sink_writer, NULL, sinkWriter, s) != 0) {
+        printf("Failed to start the sink's writer\n");
+        free(s->sink_ptr);
+        return -1;
+    }
+    if(render && pthread_create(&s->sink_render, NULL, sinkRender, s) != 0) {
+        printf("Failed to start the sink's renderer\n");
+        s->sink_stop_write = 1;
+        pthread_join(s->sink_writer, NULL);
+        free(s->sink_ptr);
+        return -1;
+    }
+    s->sink_rendering = render;
+
+    // the callback may already be running, so the queue has to be ready
+    // before it sees the sink
+    PaUtil_WriteMemoryBarrier();
+    s->sink = sink;
+    return 0;
+}
+
+void pushSink(synth_t *s, const float *stereo, unsigned long frames)
+{
+    if((unsigned long)PaUtil_GetRingBufferWriteAvailable(&s->sink_rbuf) < frames) {
+        s->block_dropped = 1;
+        return;
+    }
+    PaUtil_WriteRingBuffer(&s->sink_rbuf, stereo, frames);
+}
+
+void *sinkRender(void *arg)
+{
+    synth_t *s = (synth_t*) arg;
+    ring_buffer_size_t fpb = s->frames_per_buffer;
+    double period = fpb / s->sample_rate;
+    double next = monotonicTime();
+    void *p1, *p2;
+    ring_buffer_size_t n1, n2;
+    struct timespec ts;
+
+    while(!s->sink_stop_render) {
+        double start = monotonicTime();
+
+        // render straight into the queue whenever the buffer fits in one
+        // piece of it, which is always unless fpb isn't a power of two.
+        // There's no device, so offline_block is free to render into
+        s->block_dropped = 0;
+        PaUtil_GetRingBufferWriteRegions(&s->sink_rbuf, fpb, &p1, &n1, &p2, &n2);
+        if(n1 == fpb) {
+            renderBlock(s, (float*)p1, fpb);
+            PaUtil_AdvanceRingBufferWriteIndex(&s->sink_rbuf, fpb);
+        } else {
+            renderBlock(s, s->offline_block, fpb);
+            pushSink(s, s->offline_block, fpb);
+        }
+        updateStats(s, monotonicTime() - start, fpb, NULL, 0);
+        wakeWaiters(s);
+
+        // keep to the sample rate, but after a stall longer than the queue
+        // start counting again rather than rushing to catch up
+        next += period;
+        double now = monotonicTime();
+        if(next < now - SINK_BUFFERS * period)
+            next = now;
+        else if(next > now) {
+            ts.tv_sec = (time_t)next;
+            ts.tv_nsec = (long)((next - ts.tv_sec) * 1e9);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+void *sinkWriter(void *arg)
+{
+    synth_t *s = (synth_t*) arg;
+    void *p1, *p2;
+    ring_buffer_size_t n1, n2;
+    int broken = 0;
+
+    for(;;) {
+        // stop is checked before the queue, so everything queued before it
+        // was set still gets written
+        int stop = s->sink_stop_write;
+        PaUtil_ReadMemoryBarrier();
+
+        // the frames go to the sink straight out of the queue
+        ring_buffer_size_t n = PaUtil_GetRingBufferReadRegions(&s->sink_rbuf,
+            s->sink_rbuf.bufferSize, &p1, &n1, &p2, &n2);
+        if(n == 0) {
+            if(stop)
+                break;
+            sleepBuffer(s);
+            continue;
+        }
+
+        // a broken sink is still drained, so rendering carries on as normal
+        if(!broken && (s->sink->write(s->sink, (float*)p1, n1) != 0 ||
+                       (n2 > 0 && s->sink->write(s->sink, (float*)p2, n2) != 0))) {
+            printf("Output sink failed\n");
+            broken = 1;
+        }
+        PaUtil_AdvanceRingBufferReadIndex(&s->sink_rbuf, n);
+    }
+    return NULL;
+}
+
+void stopSink(synth_t *s)
+{
+    struct synth_sink *sink = s->sink;
+
+    if(sink == NULL)
+        return;
+    if(s->sink_rendering) {
+        s->sink_stop_render = 1;
+        pthread_join(s->sink_render, NULL);
+    }
+    PaUtil_WriteMemoryBarrier();
+    s->sink_stop_write = 1;
+    pthread_join(s->sink_writer, NULL);
+
+    if(sink->close(sink) != 0)
+        printf("Failed to close the output sink\n");
+    free(s->sink_ptr);
+    s->sink = NULL;
+}
+
+void synthDestroy(synth_t *s)
+{
+    // only oscillators that were used have to finish. Offline, nothing
+    // would ever play them, so there's nothing to wait for
+    if(!s->offline)
+        while(!synthIsFinished(s))
+            waitCallback(s, WAIT_FALLBACK_MS);
+    closeSynth(s, 0);
+}
+
+int synthDestroyTimeout(synth_t *s, unsigned int timeout_ms)
+{
+    double deadline = monotonicTime() + timeout_ms / 1000.0;
+
+    if(s->offline) {
+        closeSynth(s, 0);
+        return 0;
+    }
+
+    while(!synthIsFinished(s)) {
+        double left = deadline - monotonicTime();
+        if(left <= 0) {
+            closeSynth(s, 1);
+            return -1;
+        }
+        int ms = (int)(left * 1000) + 1;
+        waitCallback(s, ms < WAIT_FALLBACK_MS ? ms : WAIT_FALLBACK_MS);
+    }
+    closeSynth(s, 0);
+    return 0;
+}
+
+void synthDestroyForce(synth_t *s)
+{
+    closeSynth(s, 1);
+}
+
+void closeSynth(synth_t *s, int abort)
+{
+    PaError  err;
+
+    // the legacy functions were called without an init
+    if(s == &idle_synth)
+        return;
+
+    // a lazy instance that never played has nothing to close
+    if(!s->offline && s->stream != NULL) {
+        // stopping lets the buffers already handed to the device play out,
+        // aborting throws them away too
+        err = abort ? Pa_AbortStream(s->stream) : Pa_StopStream(s->stream);
+        if (err != paNoError)
+        {
+            printf("StopStream failed\n");
+            error(err);
+        }
+
+        err = Pa_CloseStream(s->stream);
+        if (err != paNoError)
+        {
+            printf("Failed to close stream\n");
+            error(err);
+        }
+        Pa_Terminate();
+    }
+
+    // after the stream, so the sink gets everything that was played
+    stopSink(s);
+    stopRenderPool(s);
+    if(s->lazy)
+        pthread_mutex_destroy(&s->open_lock);
+
+    if(s == default_synth)
+        default_synth = &idle_synth;
+    free(s);
+}
+
+int initSynth(void)
+{
+    return initSynthVoices(DEFAULT_NUM_OSCILLATORS);
+}
+
+int initSynthVoices(unsigned int num_voices)
+{
+    struct synth_config config;
+    synthDefaultConfig(&config);
+    config.voices = num_voices;
+    return initSynthEx(&config);
+}
+
+int initSynthEx(const struct synth_config *config)
+{
+    synth_t *s = synthCreate(config);
+    if(s == NULL)
+        return -1;
+    default_synth = s;
+    return 0;
+}
+
+void termSynth(void)
+{
+    synthDestroy(default_synth);
+}
+
+int termSynthTimeout(unsigned int timeout_ms)
+{
+    return synthDestroyTimeout(default_synth, timeout_ms);
+}
+
+void termSynthForce(void)
+{
+    synthDestroyForce(default_synth);
+}
+
+int initSynthOffline(unsigned int num_voices)
+{
+    struct synth_config config;
+    synthDefaultConfig(&config);
+    config.voices = num_voices;
+    return initSynthOfflineEx(&config);
+}
+
+int initSynthOfflineEx(const struct synth_config *config)
+{
+    synth_t *s = synthCreateOffline(config);
+    if(s == NULL)
+        return -1;
+    default_synth = s;
+    return 0;
+}
+
+void termSynthOffline(void)
+{
+    synthDestroy(default_synth);
+}
+
+int oscDone(unsigned int id)
+{
+    return synthOscDone(default_synth, id);
+}
+
+int synthFinished(void)
+{
+    return synthIsFinished(default_synth);
+}
+
+int allocOsc(void)
+{
+    return synthAllocOsc(default_synth);
+}
+
+int playOsc(unsigned int id, unsigned int ms, double hz)
+{
+    return synthPlayOsc(default_synth, id, ms, hz);
+}
+
+int restOsc(unsigned int id, unsigned int ms)
+{
+    return synthRestOsc(default_synth, id, ms);
+}
+
+int endOsc(unsigned int id)
+{
+    return synthEndOsc(default_synth, id);
+}
+
+size_t playOscBatch(unsigned int id, const struct note *notes, size_t count)
+{
+    return synthPlayOscBatch(default_synth, id, notes, count);
+}
+
+size_t playOscBatchWait(unsigned int id, const struct note *notes, size_t count)
+{
+    return synthPlayOscBatchWait(default_synth, id, notes, count);
+}
+
+unsigned int oscQueueSpace(unsigned int id)
+{
+    return synthOscQueueSpace(default_synth, id);
+}
+
+int waitOscSpace(unsigned int id, unsigned int count)
+{
+    return synthWaitOscSpace(default_synth, id, count);
+}
+
+unsigned int oscQueueFill(unsigned int id)
+{
+    return synthOscQueueFill(default_synth, id);
+}
+
+long noteOn(double hz, unsigned int ms, double velocity)
+{
+    return synthNoteOn(default_synth, hz, ms, velocity);
+}
+
+int noteOff(long handle)
+{
+    return synthNoteOff(default_synth, handle);
+}
+
+int setOscWave(unsigned int id, enum wave_type wave)
+{
+    return synthSetOscWave(default_synth, id, wave);
+}
+
+int setOscTable(unsigned int id, int table)
+{
+    return synthSetOscTable(default_synth, id, table);
+}
+
+int setOscFreq(unsigned int id, double hz)
+{
+    return synthSetOscFreq(default_synth, id, hz);
+}
+
+int setOscGain(unsigned int id, double gain)
+{
+    return synthSetOscGain(default_synth, id, gain);
+}
+
+int setOscPan(unsigned int id, double pan)
+{
+    return synthSetOscPan(default_synth, id, pan);
+}
+
+int setOscBus(unsigned int id, unsigned int bus)
+{
+    return synthSetOscBus(default_synth, id, bus);
+}
+
+int setBusGain(unsigned int bus, double gain)
+{
+    return synthSetBusGain(default_synth, bus, gain);
+}
+
+int setMasterGain(double gain)
+{
+    return synthSetMasterGain(default_synth, gain);
+}
+
+void setOscEnvelope(unsigned int id, double attack_ms, double decay_ms,
+                    double sustain, double release_ms)
+{
+    synthSetOscEnvelope(default_synth, id, attack_ms, decay_ms, sustain,
+        release_ms);
+}
+
+void getSynthStats(struct synth_stats *stats)
+{
+    synthGetStats(default_synth, stats);
+}
+
+double getSynthLatency(void)
+{
+    return synthGetLatency(default_synth);
+}
+
+void resetSynthStats(void)
+{
+    synthResetStats(default_synth);
+}
+
+void setSynthThreads(unsigned int num_threads)
+{
+    default_threads = num_threads > 0 ? num_threads : 1;
+    synthSetThreads(default_synth, num_threads);
+}
+
+void renderSynth(float *out, size_t frames)
+{
+    synthRender(default_synth, out, frames);
+}
+
+long renderSynthToFile(const char *path, size_t max_frames)
+{
+    return synthRenderToFile(default_synth, path, max_frames);
+}
+
+void synthSetThreads(synth_t *s, unsigned int num_threads)
+{
+    num_threads = num_threads > 0 ? num_threads : 1;
+    // the next threaded render starts as many workers as it needs
+    if(num_threads != s->render_threads)
+        stopRenderPool(s);
+    s->render_threads = num_threads;
+}
+
+void synthRender(synth_t *s, float *out, size_t frames)
+{
+    renderOffline(s, out, frames, 0);
+}
+
+size_t renderOffline(synth_t *s, float *out, size_t frames, int stop)
+{
+    size_t done = 0;
+    unsigned long fpb = s->frames_per_buffer;
+
+    while(done < frames) {
+        // hand out what's left of the last partial buffer first
+        if(s->offline_pending > 0) {
+            size_t n = frames - done;
+            if(n > s->offline_pending)
+                n = s->offline_pending;
+            memcpy(out + 2 * done,
+                s->offline_block + 2 * (fpb - s->offline_pending),
+                sizeof(float) * 2 * n);
+            s->offline_pending -= n;
+            done += n;
+            continue;
+        }
+
+        if(stop && synthIsFinished(s))
+            break;
+
+        // whole buffers can go straight to out
+        size_t buffers = (frames - done) / fpb;
+        if(buffers > 1 && s->render_threads > 1 && startRenderPool(s) == 0) {
+            unsigned int n = renderThreaded(s, out + 2 * done, buffers, stop);
+            done += (size_t)n * fpb;
+            if(n < buffers)
+                break;
+        }
+        else if(buffers > 0) {
+            renderBlock(s, out + 2 * done, fpb);
+            done += fpb;
+        }
+        else {
+            renderBlock(s, s->offline_block, fpb);
+            s->offline_pending = fpb;
+        }
+    }
+
+    return done;
+}
+
+unsigned int renderThreaded(synth_t *s, float *out, unsigned int buffers,
+                            int stop)
+{
+    struct render_segment *seg = s->render_pool;
+    unsigned int i, done = 0;
+    unsigned int voices = s->num_oscillators;
+
+    while(done < buffers) {
+        unsigned int id, b;
+
+        seg->out = out + 2 * s->frames_per_buffer * done;
+        seg->buffers = buffers - done;
+        if(seg->buffers > SEGMENT_BUFFERS)
+            seg->buffers = SEGMENT_BUFFERS;
+
+        // nothing gets queued while rendering offline, so everything listed
+        // so far shows up in the first buffer's drain, as in renderBlock
+        while(PaUtil_ReadRingBuffer(&s->activate_rbuf, &id, 1) == 1)
+            s->active[s->num_active++] = id;
+        drainControls(s);
+        seg->num_voices = s->num_active;
+        for(i = 0; i < s->num_active; i++) {
+            seg->voices[i] = s->active[i];
+            seg->slot[s->active[i]] = i;
+        }
+
+        pthread_barrier_wait(&seg->barrier);
+        renderSegmentOscs(seg, 0);
+        pthread_barrier_wait(&seg->barrier);
+
+        // replay how renderBlock walks the active list and retires
+        // oscillators, so every buffer is mixed in the same order
+        for(b = 0; b < seg->buffers; b++) {
+            unsigned int *order = seg->order + b * voices;
+            seg->order_count[b] = 0;
+            for(i = 0; i < s->num_active; i++) {
+                order[seg->order_count[b]++] = s->active[i];
+                if(seg->retire[seg->slot[s->active[i]]] == (int)b && retireOsc(s, i))
+                    i--;
+            }
+        }
+
+        pthread_barrier_wait(&seg->barrier);
+        mixSegment(seg, 0);
+        pthread_barrier_wait(&seg->barrier);
+
+        // stop after the buffer the last END was played in, which is where
+        // calling renderBlock one buffer at a time would have stopped
+        if(stop && synthIsFinished(s)) {
+            int last = -1;
+            for(i = 0; i < seg->num_voices; i++) {
+                if(seg->last_end[i] > last)
+                    last = seg->last_end[i];
+            }
+            done += last + 1;
+            break;
+        }
+        done += seg->buffers;
+    }
+
+    return done;
+}
+
+int startRenderPool(synth_t *s)
+{
+    struct render_segment *seg;
+    unsigned int t, started;
+    unsigned int voices = s->num_oscillators;
+    unsigned int samples = s->frames_per_buffer * SEGMENT_BUFFERS;
+
+    if(s->render_pool != NULL)
+        return 0;
+
+    seg = calloc(1, sizeof(*seg));
+    if(seg == NULL) {
+        printf("Failed to allocate the render threads, rendering on one\n");
+        s->render_threads = 1;
+        return -1;
+    }
+    seg->synth = s;
+    seg->num_threads = s->render_threads;
+    seg->voices = malloc(sizeof(unsigned int) * voices);
+    seg->slot = malloc(sizeof(unsigned int) * voices);
+    seg->retire = malloc(sizeof(int) * voices);
+    seg->last_end = malloc(sizeof(int) * voices);
+    seg->samples = malloc(sizeof(float) * samples * voices);
+    seg->rendered = malloc(SEGMENT_BUFFERS * voices);
+    seg->mix = malloc(sizeof(struct mix_ramp) * SEGMENT_BUFFERS * voices);
+    seg->order = malloc(sizeof(unsigned int) * SEGMENT_BUFFERS * voices);
+    seg->order_count = malloc(sizeof(unsigned int) * SEGMENT_BUFFERS);
+    seg->workers = malloc(sizeof(struct render_worker) * seg->num_threads);
+    if(seg->voices == NULL || seg->slot == NULL || seg->retire == NULL ||
+       seg->last_end == NULL || seg->samples == NULL || seg->rendered == NULL ||
+       seg->mix == NULL || seg->order == NULL || seg->order_count == NULL ||
+       seg->workers == NULL) {
+        printf("Failed to allocate the render threads, rendering on one\n");
+        freeRenderPool(seg);
+        s->render_threads = 1;
+        return -1;
+    }
+
+    if(pthread_barrier_init(&seg->barrier, NULL, seg->num_threads) != 0) {
+        printf("Failed to start the render threads, rendering on one\n");
+        freeRenderPool(seg);
+        s->render_threads = 1;
+        return -1;
+    }
+    pthread_mutex_init(&seg->gate_lock, NULL);
+    pthread_cond_init(&seg->gate, NULL);
+
+    for(started = 1; started < seg->num_threads; started++) {
+        seg->workers[started].seg = seg;
+        seg->workers[started].thread = started;
+        if(pthread_create(&seg->workers[started].handle, NULL, renderWorker,
+                          &seg->workers[started]) != 0)
+            break;
+    }
+
+    // let them all through, or back out if one didn't start
+    pthread_mutex_lock(&seg->gate_lock);
+    seg->quit = started < seg->num_threads;
+    seg->gate_open = 1;
+    pthread_cond_broadcast(&seg->gate);
+    pthread_mutex_unlock(&seg->gate_lock);
+
+    if(seg->quit) {
+        printf("Failed to start the render threads, rendering on one\n");
+        for(t = 1; t < started; t++)
+            pthread_join(seg->workers[t].handle, NULL);
+        pthread_barrier_destroy(&seg->barrier);
+        pthread_cond_destroy(&seg->gate);
+        pthread_mutex_destroy(&seg->gate_lock);
+        freeRenderPool(seg);
+        s->render_threads = 1;
+        return -1;
+    }
+
+    s->render_pool = seg;
+    return 0;
+}
+
+void stopRenderPool(synth_t *s)
+{
+    struct render_segment *seg = s->render_pool;
+    unsigned int t;
+
+    if(seg == NULL)
+        return;
+
+    seg->quit = 1;
+    pthread_barrier_wait(&seg->barrier);
+    for(t = 1; t < seg->num_threads; t++)
+        pthread_join(seg->workers[t].handle, NULL);
+
+    pthread_barrier_destroy(&seg->barrier);
+    pthread_cond_destroy(&seg->gate);
+    pthread_mutex_destroy(&seg->gate_lock);
+    freeRenderPool(seg);
+    s->render_pool = NULL;
+}
+
+void freeRenderPool(struct render_segment *seg)
+{
+    free(seg->workers);
+    free(seg->order_count);
+    free(seg->order);
+    free(seg->mix);
+    free(seg->rendered);
+    free(seg->samples);
+    free(seg->last_end);
+    free(seg->retire);
+    free(seg->slot);
+    free(seg->voices);
+    free(seg);
+}
+
+void *renderWorker(void *arg)
+{
+    struct render_worker *w = (struct render_worker*) arg;
+    struct render_segment *seg = w->seg;
+
+    pthread_mutex_lock(&seg->gate_lock);
+    while(!seg->gate_open)
+        pthread_cond_wait(&seg->gate, &seg->gate_lock);
+    pthread_mutex_unlock(&seg->gate_lock);
+    if(seg->quit)
+        return NULL;
+
+    for(;;) {
+        pthread_barrier_wait(&seg->barrier);
+        if(seg->quit)
+            break;
+        renderSegmentOscs(seg, w->thread);
+        pthread_barrier_wait(&seg->barrier);
+        pthread_barrier_wait(&seg->barrier);
+        mixSegment(seg, w->thread);
+        pthread_barrier_wait(&seg->barrier);
+    }
+    return NULL;
+}
+
+void renderSegmentOscs(struct render_segment *seg, unsigned int thread)
+{
+    synth_t *s = seg->synth;
+    unsigned long fpb = s->frames_per_buffer;
+    unsigned int v, b;
+
+    // the workers run the callback's per-oscillator code, so it's held to
+    // the same rules
+    rtEnter();
+
+    // oscillators are striped across the threads
+    for(v = thread; v < seg->num_voices; v += seg->num_threads) {
+        unsigned int id = seg->voices[v];
+        struct osc *o = &s->oscillators[id];
+        unsigned int base = v * SEGMENT_BUFFERS;
+
+        seg->retire[v] = -1;
+        seg->last_end[v] = -1;
+        memset(seg->rendered + base, 0, SEGMENT_BUFFERS);
+
+        for(b = 0; b < seg->buffers; b++) {
+            int ended;
+            seg->rendered[base + b] = renderOscBlock(s, id,
+                seg->samples + (base + b) * fpb, fpb, &ended, &seg->mix[base + b]);
+
+            if(ended) {
+                seg->last_end[v] = b;
+
+                // renderBlock would retire it here, since nothing can be
+                // queued behind the END while rendering offline
+                if(PaUtil_GetRingBufferReadAvailable(&o->rbuf) == 0) {
+                    seg->retire[v] = b;
+                    break;
+                }
+            }
+        }
+    }
+    rtLeave();
+}
+
+void mixSegment(struct render_segment *seg, unsigned int thread)
+{
+    synth_t *s = seg->synth;
+    unsigned long fpb = s->frames_per_buffer;
+    unsigned int i, b;
+
+    rtEnter();
+
+    // buffers are striped across the threads. Each one adds up the same
+    // oscillators in the same order as renderBlock, so the sums are identical
+    for(b = thread; b < seg->buffers; b += seg->num_threads) {
+        float *out = seg->out + b * 2 * fpb;
+        unsigned int *order = seg->order + b * s->num_oscillators;
+
+        memset(out, 0, sizeof(float) * 2 * fpb);
+        for(i = 0; i < seg->order_count[b]; i++) {
+            unsigned int k = seg->slot[order[i]] * SEGMENT_BUFFERS + b;
+            if(seg->rendered[k])
+                kernelMix(out, seg->samples + k * fpb, fpb, seg->mix[k].left,
+                    seg->mix[k].right, seg->mix[k].step_left, seg->mix[k].step_right);
+        }
+    }
+    rtLeave();
+}
+
+long synthRenderToFile(synth_t *s, const char *path, size_t max_frames)
+{
+    struct wav_file wav;
+    size_t chunk = s->frames_per_buffer;
+    size_t written = 0;
+
+    // give every thread whole segments to work on
+    if(s->render_threads > 1)
+        chunk *= SEGMENT_BUFFERS * s->render_threads;
+    float *block = malloc(sizeof(float) * 2 * chunk);
+    if(block == NULL) {
+        printf("Failed to allocate the render block\n");
+        return -1;
+    }
+
+    if(wavOpen(&wav, path, 2, (unsigned int)(s->sample_rate + 0.5)) != 0) {
+        free(block);
+        return -1;
+    }
+
+    // the buffer the synth finished in may still be partly in offline_block
+    while((!synthIsFinished(s) || s->offline_pending > 0) &&
+          (max_frames == 0 || written < max_frames)) {
+        size_t n = chunk;
+        if(max_frames != 0 && max_frames - written < n)
+            n = max_frames - written;
+
+        n = renderOffline(s, block, n, 1);
+        if(wavWrite(&wav, block, n) != 0) {
+            wavClose(&wav);
+            free(block);
+            return -1;
+        }
+        written += n;
+    }
+
+    free(block);
+    if(wavClose(&wav) != 0)
+        return -1;
+    return written;
 }
@@ -1,10 +1,156 @@
 #ifndef _SYNTH_
 #define _SYNTH_
 
-void initSynth(void);
+#include <stddef.h>
+
+enum note_type {
+    NOTE,       // a note with a millisecond duration (ms) and frequency (hz)
+    REST,       // a note with a millisecont duration (ms) but no sound
+    WAITING,    // signifies that no note was read from the RingBuffer
+    END,        // signals that this oscillator is done being used
+    VELOCITY    // sets the level (hz, 0 to 1) of the notes after it. Takes no time
+};
+
+struct note {
+    enum note_type type;
+    int ms;
+    double hz;
+};
+
+// stream settings for initSynthEx. synthDefaultConfig fills in what
+// initSynth uses, so only the fields that matter need to be changed
+struct synth_config {
+    double sample_rate;
+    unsigned long frames_per_buffer;    // frames per callback, 0 to let the host pick with block_frames set
+    unsigned int block_frames;          // frames rendered at a time inside a callback, 0 for all of them
+    double latency;                     // suggested output latency in seconds, 0 for the device's lowest
+    int device;                         // PortAudio device index, -1 for the default output
+    int channels;                       // output channels. Mono gets a mix of both sides
+    unsigned int voices;                // oscillators in the pool
+    unsigned int queue_size;            // notes per oscillator queue, 0 to keep the current size
+    int lazy_start;                     // open the device on the first note instead of right away
+    unsigned int idle_ms;               // stop the stream after this long with nothing playing, 0 never
+};
+
+enum wave_type {
+    WAVE_SINE,
+    WAVE_SAW,
+    WAVE_NOISE,     // white noise
+    WAVE_PINK,      // pink noise, 3 dB quieter every octave up
+    WAVE_TABLE      // tables from addWavetable, see wavetable.h. Picked with setOscTable
+};
+
+// submix buses oscillators can be sent to with setOscBus. Each has a gain of
+// its own, and the master gain scales all of them
+#define SYNTH_BUSES (4)
+
+// callbacks are bucketed by how much of the buffer period rendering took,
+// in steps of SYNTH_LOAD_BUCKET_WIDTH. the last bucket holds everything above
+#define SYNTH_LOAD_BUCKETS (16)
+#define SYNTH_LOAD_BUCKET_WIDTH (0.125)
+
+struct synth_stats {
+    unsigned long callbacks;
+    unsigned long underflows;       // callbacks PortAudio flagged as output underflow
+    unsigned long overruns;         // callbacks that took longer than their buffer
+    unsigned int max_active;        // most oscillators active in one callback
+    double max_load;                // longest render time, in buffer periods
+    double output_latency;          // seconds from the last callback to its output
+    unsigned long sink_drops;       // callbacks whose output didn't fit in the sink's queue
+    unsigned long load_histogram[SYNTH_LOAD_BUCKETS];
+};
+
+// one synth with its own stream, oscillator pool and queues. Any number can
+// run at once; the functions without a synth_t work on the one made by the
+// last initSynth* call
+typedef struct synth synth_t;
+
+// somewhere other than a sound device for output to go, see sink.h
+struct synth_sink;
+
+int initSynth(void);
+int initSynthVoices(unsigned int num_voices);
+void synthDefaultConfig(struct synth_config *config);
+void synthLowLatencyConfig(struct synth_config *config);
+int initSynthEx(const struct synth_config *config);
 void termSynth(void);
-void playOsc(unsigned int id, unsigned int ms, double hz);
-void restOsc(unsigned int id, unsigned int ms);
-void endOsc(unsigned int id);
+int termSynthTimeout(unsigned int timeout_ms);
+void termSynthForce(void);
+int oscDone(unsigned int id);
+int allocOsc(void);
+long noteOn(double hz, unsigned int ms, double velocity);
+int noteOff(long handle);
+int playOsc(unsigned int id, unsigned int ms, double hz);
+int restOsc(unsigned int id, unsigned int ms);
+int endOsc(unsigned int id);
+size_t playOscBatch(unsigned int id, const struct note *notes, size_t count);
+size_t playOscBatchWait(unsigned int id, const struct note *notes, size_t count);
+unsigned int oscQueueSpace(unsigned int id);
+int waitOscSpace(unsigned int id, unsigned int count);
+void setSynthQueueSize(unsigned int size);
+int setOscWave(unsigned int id, enum wave_type wave);
+int setOscTable(unsigned int id, int table);
+int setOscFreq(unsigned int id, double hz);
+int setOscGain(unsigned int id, double gain);
+int setOscPan(unsigned int id, double pan);
+int setOscBus(unsigned int id, unsigned int bus);
+int setBusGain(unsigned int bus, double gain);
+int setMasterGain(double gain);
+void setOscEnvelope(unsigned int id, double attack_ms, double decay_ms,
+                    double sustain, double release_ms);
+
+void getSynthStats(struct synth_stats *stats);
+double getSynthLatency(void);
+void resetSynthStats(void);
+unsigned int oscQueueFill(unsigned int id);
+
+int initSynthOffline(unsigned int num_voices);
+int initSynthOfflineEx(const struct synth_config *config);
+void termSynthOffline(void);
+int synthFinished(void);
+void setSynthThreads(unsigned int num_threads);
+void renderSynth(float *out, size_t frames);
+long renderSynthToFile(const char *path, size_t max_frames);
+
+synth_t *synthCreate(const struct synth_config *config);
+synth_t *synthCreateOffline(const struct synth_config *config);
+synth_t *synthCreateSink(const struct synth_config *config, struct synth_sink *sink);
+int synthAttachSink(synth_t *s, struct synth_sink *sink);
+void synthDestroy(synth_t *s);
+int synthDestroyTimeout(synth_t *s, unsigned int timeout_ms);
+void synthDestroyForce(synth_t *s);
+int synthAllocOsc(synth_t *s);
+long synthNoteOn(synth_t *s, double hz, unsigned int ms, double velocity);
+int synthNoteOff(synth_t *s, long handle);
+int synthPlayOsc(synth_t *s, unsigned int id, unsigned int ms, double hz);
+int synthRestOsc(synth_t *s, unsigned int id, unsigned int ms);
+int synthEndOsc(synth_t *s, unsigned int id);
+size_t synthPlayOscBatch(synth_t *s, unsigned int id,
+                         const struct note *notes, size_t count);
+size_t synthPlayOscBatchWait(synth_t *s, unsigned int id,
+                             const struct note *notes, size_t count);
+unsigned int synthOscQueueSpace(synth_t *s, unsigned int id);
+int synthWaitOscSpace(synth_t *s, unsigned int id, unsigned int count);
+unsigned int synthOscQueueFill(synth_t *s, unsigned int id);
+double synthGetSampleRate(synth_t *s);
+unsigned long synthGetBufferFrames(synth_t *s);
+int synthOscDone(synth_t *s, unsigned int id);
+int synthIsFinished(synth_t *s);
+int synthSetOscWave(synth_t *s, unsigned int id, enum wave_type wave);
+int synthSetOscTable(synth_t *s, unsigned int id, int table);
+int synthSetOscFreq(synth_t *s, unsigned int id, double hz);
+int synthSetOscGain(synth_t *s, unsigned int id, double gain);
+int synthSetOscPan(synth_t *s, unsigned int id, double pan);
+int synthSetOscBus(synth_t *s, unsigned int id, unsigned int bus);
+int synthSetBusGain(synth_t *s, unsigned int bus, double gain);
+int synthSetMasterGain(synth_t *s, double gain);
+void synthSetOscEnvelope(synth_t *s, unsigned int id, double attack_ms,
+                         double decay_ms, double sustain, double release_ms);
+void synthGetStats(synth_t *s, struct synth_stats *stats);
+double synthGetLatency(synth_t *s);
+void synthResetStats(synth_t *s);
+void synthSetThreads(synth_t *s, unsigned int num_threads);
+void synthRender(synth_t *s, float *out, size_t frames);
+long synthRenderToFile(synth_t *s, const char *path, size_t max_frames);
 
 #endif
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wav.h"
+
+#define WAV_HEADER_SIZE (44)
+#define WAV_FORMAT_FLOAT (3)
+// the most data whose size, and the RIFF size 36 bytes above it, fit the
+// header's 32-bit fields
+#define WAV_MAX_DATA (0xffffffffu - 36)
+
+// writes v as little-endian into p
+void putLE16(unsigned char *p, uint16_t v);
+void putLE32(unsigned char *p, uint32_t v);
+
+// builds the RIFF/fmt/data header for the given number of frames
+void wavHeader(unsigned char *h, const struct wav_file *wav, unsigned long frames);
+
+void putLE16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+void putLE32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+void wavHeader(unsigned char *h, const struct wav_file *wav, unsigned long frames)
+{
+    uint32_t block_align = wav->channels * sizeof(float);
+    uint32_t data_size = frames * block_align;
+
+    memcpy(h, "RIFF", 4);
+    putLE32(h + 4, 36 + data_size);
+    memcpy(h + 8, "WAVE", 4);
+
+    memcpy(h + 12, "fmt ", 4);
+    putLE32(h + 16, 16);
+    putLE16(h + 20, WAV_FORMAT_FLOAT);
+    putLE16(h + 22, wav->channels);
+    putLE32(h + 24, wav->sample_rate);
+    putLE32(h + 28, wav->sample_rate * block_align);
+    putLE16(h + 32, block_align);
+    putLE16(h + 34, 8 * sizeof(float));
+
+    memcpy(h + 36, "data", 4);
+    putLE32(h + 40, data_size);
+}
+
+int wavOpen(struct wav_file *wav, const char *path,
+            unsigned int channels, unsigned int sample_rate)
+{
+    unsigned char h[WAV_HEADER_SIZE];
+
+    wav->channels = channels;
+    wav->sample_rate = sample_rate;
+    wav->frames = 0;
+    wav->fp = fopen(path, "wb");
+    if(wav->fp == NULL) {
+        printf("Failed to open %s\n", path);
+        return -1;
+    }
+
+    wavHeader(h, wav, 0);
+    if(fwrite(h, 1, WAV_HEADER_SIZE, wav->fp) != WAV_HEADER_SIZE) {
+        fclose(wav->fp);
+        wav->fp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int wavWrite(struct wav_file *wav, const float *samples, unsigned long frames)
+{
+    unsigned long n = frames * wav->channels;
+
+    // past this the header sizes would wrap and the file would look short
+    if((uint64_t)(wav->frames + frames) * wav->channels * sizeof(float) > WAV_MAX_DATA) {
+        printf("WAV file is full after %lu frames\n", wav->frames);
+        return -1;
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // WAV is little-endian, so swap every sample on the way out
+    unsigned long i;
+    for(i = 0; i < n; i++) {
+        uint32_t v;
+        unsigned char b[4];
+        memcpy(&v, &samples[i], 4);
+        putLE32(b, v);
+        if(fwrite(b, 1, 4, wav->fp) != 4)
+            return -1;
+    }
+#else
+    if(fwrite(samples, sizeof(float), n, wav->fp) != n)
+        return -1;
+#endif
+
+    wav->frames += frames;
+    return 0;
+}
+
+int wavClose(struct wav_file *wav)
+{
+    unsigned char h[WAV_HEADER_SIZE];
+    int ret = 0;
+
+    wavHeader(h, wav, wav->frames);
+    if(fseek(wav->fp, 0, SEEK_SET) != 0 ||
+       fwrite(h, 1, WAV_HEADER_SIZE, wav->fp) != WAV_HEADER_SIZE)
+        ret = -1;
+
+    if(fclose(wav->fp) != 0)
+        ret = -1;
+    wav->fp = NULL;
+    return ret;
+}
@@ -0,0 +1,31 @@
+#ifndef _WAV_
+#define _WAV_
+
+#include <stdio.h>
+
+/*
+ * Minimal streaming writer for 32-bit float WAV files. The header is
+ * written with zero sizes on wavOpen and patched on wavClose, so frames can
+ * be appended as they are rendered without holding the whole piece.
+ */
+
+struct wav_file {
+    FILE *fp;
+    unsigned int channels;
+    unsigned int sample_rate;
+    unsigned long frames;       // frames written so far
+};
+
+// creates path and writes a placeholder header. returns 0 on success
+int wavOpen(struct wav_file *wav, const char *path,
+            unsigned int channels, unsigned int sample_rate);
+
+// appends frames of interleaved samples. returns 0 on success, or -1 if
+// the write fails or would take the data past the 4 GiB the header can
+// describe, in which case nothing is written
+int wavWrite(struct wav_file *wav, const float *samples, unsigned long frames);
+
+// fills in the header sizes and closes the file. returns 0 on success
+int wavClose(struct wav_file *wav);
+
+#endif
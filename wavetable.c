@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pa_memorybarrier.h"
+#include "wavetable.h"
+
+// a table as it's stored in memory and in the cache, header first and the
+// samples it was built from last
+struct wavetable_file {
+    struct wavetable_header header;
+    struct wave wave;
+    float samples[];
+};
+
+/* Globals */
+#ifdef SYNTH_COMPUTE_TABLES
+// filled in by initTables
+struct wave sine_wave;
+struct wave saw_wave;
+pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+#else
+// gentables runs initTables when the library is built and writes the result
+// out as tables.c, so starting up has nothing left to compute
+extern const struct wave sine_wave;
+extern const struct wave saw_wave;
+#endif
+const struct wave noise_wave = { WAVE_NOISE, 1, {{ 0 }} };
+const struct wave pink_wave = { WAVE_PINK, 1, {{ 0 }} };
+
+// the registry, with the built-in waves already in it. Entries are only
+// ever appended, and num_wavetables is moved on after the entry is
+// written, so readers never need the lock
+const struct wave *wavetables[WAVETABLE_MAX] = {
+    [WAVE_SINE] = &sine_wave,
+    [WAVE_SAW] = &saw_wave,
+    [WAVE_NOISE] = &noise_wave,
+    [WAVE_PINK] = &pink_wave
+};
+const struct wavetable_file *wavetable_files[WAVETABLE_MAX];
+volatile int num_wavetables = WAVE_TABLE;
+char *wavetable_cache = NULL;
+pthread_mutex_t wavetable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Initializes the tables of the built-in sine and saw waves
+void initTables(void);
+
+// fills every mip level of a saw wave with its band-limited harmonic series
+void initSawLevels(struct wave *w);
+
+// hashes the samples a table is built from
+uint64_t wavetableKey(const float *samples, unsigned int count);
+
+// band-limits a cycle of count samples into every mip level of w. returns
+// 0 on success
+int buildWavetable(struct wave *w, const float *samples, unsigned int count);
+
+// how many bytes a table built from count samples takes
+size_t wavetableFileSize(unsigned int count);
+
+// returns 1 if f was built from exactly these samples
+int wavetableMatches(const struct wavetable_file *f, uint64_t key,
+                     const float *samples, unsigned int count);
+
+// maps the cached table for the samples read-only. returns NULL if there
+// isn't a usable one
+const struct wavetable_file *mapCachedWavetable(uint64_t key,
+    const float *samples, unsigned int count);
+
+// writes a freshly built table to the cache. Failing to is not an error,
+// the table just gets built again next time
+void cacheWavetable(const struct wavetable_file *f);
+
+void wavetableInit(void)
+{
+#ifdef SYNTH_COMPUTE_TABLES
+    pthread_once(&tables_once, initTables);
+#endif
+}
+
+#ifdef SYNTH_COMPUTE_TABLES
+void initTables(void) {
+
+    /* Initialize the sine wave lookup table. It has no harmonics to lose */
+    int i;
+    for(i = 0; i < TABLE_SIZE; i++)
+    {
+        sine_wave.table[0][i] = (float) sin( ((double)i/(double)TABLE_SIZE) * M_PI * 2. );
+    }
+    sine_wave.table[0][TABLE_SIZE] = sine_wave.table[0][0];
+    sine_wave.type = WAVE_SINE;
+    sine_wave.levels = 1;
+
+    /* Initialize the saw wave lookup tables */
+    initSawLevels(&saw_wave);
+}
+#endif
+
+void initSawLevels(struct wave *w)
+{
+    unsigned int level;
+    int i, k;
+
+    // 1 - 2x over a period is 2/pi * sum(sin(2pi k x) / k)
+    for(level = 0; level < MIP_LEVELS; level++) {
+        int harmonics = (TABLE_SIZE / 2 - 1) >> level;
+        for(i = 0; i < TABLE_SIZE; i++) {
+            double x = (double)i / TABLE_SIZE;
+            double sum = 0;
+            for(k = 1; k <= harmonics; k++)
+                sum += sin(2. * M_PI * k * x) / k;
+            w->table[level][i] = (float)(sum * 2. / M_PI);
+        }
+        w->table[level][TABLE_SIZE] = w->table[level][0];
+    }
+    w->type = WAVE_SAW;
+    w->levels = MIP_LEVELS;
+}
+
+const struct wave *wavetableGet(int handle)
+{
+    wavetableInit();
+    if(handle < 0 || handle >= num_wavetables)
+        return NULL;
+    PaUtil_ReadMemoryBarrier();
+    return wavetables[handle];
+}
+
+const struct wave *wavetableAt(int handle)
+{
+    return wavetables[handle];
+}
+
+void setWavetableCache(const char *dir)
+{
+    pthread_mutex_lock(&wavetable_lock);
+    free(wavetable_cache);
+    wavetable_cache = dir != NULL ? strdup(dir) : NULL;
+    pthread_mutex_unlock(&wavetable_lock);
+}
+
+uint64_t wavetableKey(const float *samples, unsigned int count)
+{
+    // FNV-1a over the count and the samples' bytes
+    uint64_t h = 14695981039346656037ULL;
+    const unsigned char *p = (const unsigned char*) samples;
+    size_t i;
+
+    for(i = 0; i < sizeof(count); i++) {
+        h ^= (count >> (8 * i)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    for(i = 0; i < (size_t)count * sizeof(float); i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int buildWavetable(struct wave *w, const float *samples, unsigned int count)
+{
+    unsigned int harmonics = (TABLE_SIZE / 2 - 1);
+    unsigned int level, i, k, n;
+
+    // anything at or above half the source's rate isn't in it to begin with
+    if(harmonics > (count - 1) / 2)
+        harmonics = (count - 1) / 2;
+
+    double *cos_n = malloc(sizeof(double) * 2 * count);
+    if(cos_n == NULL)
+        return -1;
+    double *sin_n = cos_n + count;
+    double re[TABLE_SIZE / 2], im[TABLE_SIZE / 2];
+    double cos_t[TABLE_SIZE], sin_t[TABLE_SIZE];
+
+    for(n = 0; n < count; n++) {
+        cos_n[n] = cos(2. * M_PI * n / count);
+        sin_n[n] = sin(2. * M_PI * n / count);
+    }
+    for(i = 0; i < TABLE_SIZE; i++) {
+        cos_t[i] = cos(2. * M_PI * i / TABLE_SIZE);
+        sin_t[i] = sin(2. * M_PI * i / TABLE_SIZE);
+    }
+
+    // the harmonics of the cycle. The DC offset is left out, it would only
+    // thump at the start and end of every note
+    for(k = 1; k <= harmonics; k++) {
+        double a = 0, b = 0;
+        unsigned int at = 0;
+        for(n = 0; n < count; n++) {
+            a += samples[n] * cos_n[at];
+            b += samples[n] * sin_n[at];
+            at += k;
+            if(at >= count)
+                at -= count;
+        }
+        re[k] = a * 2 / count;
+        im[k] = b * 2 / count;
+    }
+
+    // and every level put back together from as many of them as it holds
+    for(level = 0; level < MIP_LEVELS; level++) {
+        unsigned int top = (TABLE_SIZE / 2 - 1) >> level;
+        if(top > harmonics)
+            top = harmonics;
+        for(i = 0; i < TABLE_SIZE; i++) {
+            double sum = 0;
+            for(k = 1; k <= top; k++) {
+                unsigned int at = (k * i) & (TABLE_SIZE - 1);
+                sum += re[k] * cos_t[at] + im[k] * sin_t[at];
+            }
+            w->table[level][i] = (float)sum;
+        }
+        w->table[level][TABLE_SIZE] = w->table[level][0];
+    }
+    w->type = WAVE_TABLE;
+    w->levels = MIP_LEVELS;
+    free(cos_n);
+    return 0;
+}
+
+size_t wavetableFileSize(unsigned int count)
+{
+    return sizeof(struct wavetable_file) + sizeof(float) * (size_t)count;
+}
+
+int wavetableMatches(const struct wavetable_file *f, uint64_t key,
+                     const float *samples, unsigned int count)
+{
+    return f->header.key == key && f->header.count == count &&
+        memcmp(f->samples, samples, sizeof(float) * (size_t)count) == 0;
+}
+
+const struct wavetable_file *mapCachedWavetable(uint64_t key,
+    const float *samples, unsigned int count)
+{
+    char path[4096];
+    struct stat st;
+    size_t size = wavetableFileSize(count);
+
+    if(wavetable_cache == NULL)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/%016llx.wt", wavetable_cache,
+             (unsigned long long)key);
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+
+    // a table built with other sizes, or for other samples, is rebuilt
+    const struct wavetable_file *f = map;
+    if(memcmp(f->header.magic, WAVETABLE_MAGIC, 4) != 0 ||
+       f->header.version != WAVETABLE_VERSION ||
+       f->header.table_bits != TABLE_BITS ||
+       f->header.levels != MIP_LEVELS ||
+       !wavetableMatches(f, key, samples, count) ||
+       f->wave.type != WAVE_TABLE || f->wave.levels != MIP_LEVELS) {
+        munmap(map, size);
+        return NULL;
+    }
+    return f;
+}
+
+void cacheWavetable(const struct wavetable_file *f)
+{
+    char path[4096], tmp[4096 + 16];
+    size_t size = wavetableFileSize(f->header.count);
+
+    if(wavetable_cache == NULL)
+        return;
+    snprintf(path, sizeof(path), "%s/%016llx.wt", wavetable_cache,
+             (unsigned long long)f->header.key);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    // written aside and renamed into place, so other processes only ever
+    // see whole tables. Samples that share a key take turns in the file
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return;
+    int ok = write(fd, f, size) == (ssize_t)size;
+    if(close(fd) != 0 || !ok || rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
+int addWavetable(const float *samples, unsigned int count)
+{
+    int handle, i;
+
+    if(samples == NULL || count < 3) {
+        printf("A wavetable needs at least 3 samples\n");
+        return -1;
+    }
+    wavetableInit();
+    uint64_t key = wavetableKey(samples, count);
+
+    pthread_mutex_lock(&wavetable_lock);
+    for(i = WAVE_TABLE; i < num_wavetables; i++) {
+        if(wavetableMatches(wavetable_files[i], key, samples, count)) {
+            pthread_mutex_unlock(&wavetable_lock);
+            return i;
+        }
+    }
+    if(num_wavetables == WAVETABLE_MAX) {
+        pthread_mutex_unlock(&wavetable_lock);
+        printf("Too many wavetables\n");
+        return -1;
+    }
+
+    const struct wavetable_file *f = mapCachedWavetable(key, samples, count);
+    if(f == NULL) {
+        // tables get a mapping of their own, so it can be made read-only
+        size_t size = wavetableFileSize(count);
+        struct wavetable_file *built = mmap(NULL, size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(built == MAP_FAILED) {
+            pthread_mutex_unlock(&wavetable_lock);
+            printf("Failed to allocate a wavetable\n");
+            return -1;
+        }
+        memcpy(built->header.magic, WAVETABLE_MAGIC, 4);
+        built->header.version = WAVETABLE_VERSION;
+        built->header.table_bits = TABLE_BITS;
+        built->header.levels = MIP_LEVELS;
+        built->header.key = key;
+        built->header.count = count;
+        memcpy(built->samples, samples, sizeof(float) * (size_t)count);
+        if(buildWavetable(&built->wave, samples, count) != 0) {
+            munmap(built, size);
+            pthread_mutex_unlock(&wavetable_lock);
+            printf("Failed to allocate a wavetable\n");
+            return -1;
+        }
+        mprotect(built, size, PROT_READ);
+        cacheWavetable(built);
+        f = built;
+    }
+
+    // the entry has to be there before anyone can see the handle
+    handle = num_wavetables;
+    wavetables[handle] = &f->wave;
+    wavetable_files[handle] = f;
+    PaUtil_WriteMemoryBarrier();
+    num_wavetables = handle + 1;
+    pthread_mutex_unlock(&wavetable_lock);
+    return handle;
+}
+
+int loadWavetable(const char *path)
+{
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("Failed to open %s\n", path);
+        return -1;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size % sizeof(float) != 0) {
+        printf("%s is not a wavetable\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        printf("Failed to map %s\n", path);
+        return -1;
+    }
+
+    int handle = addWavetable(map, st.st_size / sizeof(float));
+    munmap(map, st.st_size);
+    return handle;
+}
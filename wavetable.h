@@ -0,0 +1,78 @@
+#ifndef _WAVETABLE_
+#define _WAVETABLE_
+
+#include <stdint.h>
+#include "synth.h"
+
+/*
+ * The wavetable registry. Every waveform an oscillator can play is a table
+ * in here, referenced by its handle from any oscillator of any instance.
+ * The built-in waves hold the handles of their enum wave_type values, and
+ * addWavetable registers tables of your own after them.
+ *
+ * Tables never change or go away once they're in, so the audio thread reads
+ * them without locking. The built-in ones are generated along with the
+ * library and are just constant data. A table from addWavetable is
+ * band-limited into mip levels, which is the slow part, so with a cache
+ * directory set the result is also written there and later processes just
+ * map it in read-only, sharing the pages with everyone else who has it.
+ */
+
+#define TABLE_BITS (8)
+#define TABLE_SIZE (1 << TABLE_BITS)
+#define MIP_LEVELS (7)
+#define WAVETABLE_MAX (4096)
+
+// a waveform as band-limited tables, one per mip level. Level k holds at most
+// (TABLE_SIZE / 2 - 1) >> k harmonics, so every level up halves the top
+// harmonic. Each table has a guard point, a copy of its first sample, so
+// interpolated lookups never have to wrap. Noise has no tables; it's
+// generated a block at a time instead
+struct wave {
+    enum wave_type type;
+    unsigned int levels;
+    float table[MIP_LEVELS][TABLE_SIZE + 1];
+};
+
+// what comes before the wave in a cache file. It's a cache line long, so
+// the tables that follow stay aligned in the mapping. The samples the wave
+// was built from come after it, so a table is only ever taken for the same
+// samples, never for others that happen to share the key
+#define WAVETABLE_MAGIC "SYNW"
+#define WAVETABLE_VERSION (2)
+
+struct wavetable_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t table_bits;
+    uint32_t levels;
+    uint64_t key;               // hash of the samples the table was built from
+    uint32_t count;             // number of those samples
+    uint32_t reserved[9];
+};
+
+// builds the built-in waves, once, when they weren't generated at build
+// time (SYNTH_COMPUTE_TABLES). Everything else here but wavetableAt calls
+// it first
+void wavetableInit(void);
+
+// returns the wave with the given handle, or NULL if there is none
+const struct wave *wavetableGet(int handle);
+
+// returns the wave with a handle wavetableGet has already accepted. It
+// doesn't check or wait for anything, so it's the one for the audio thread
+const struct wave *wavetableAt(int handle);
+
+// sets the directory tables from addWavetable are cached in, or turns the
+// cache off for NULL. The directory has to exist already
+void setWavetableCache(const char *dir);
+
+// registers a single cycle of count samples as a wavetable, band-limited
+// into mip levels. Adding the same samples twice gives the same handle.
+// returns its handle, or -1 if it can't be added
+int addWavetable(const float *samples, unsigned int count);
+
+// the same, for a file of raw 32-bit float samples holding one cycle
+int loadWavetable(const char *path);
+
+#endif